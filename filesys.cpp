@@ -3,29 +3,247 @@
 #include <cmath>
 #include <iostream>
 #include <stdexcept>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <thread>
+// The SIMD hash kernels sign-extend chars, so they need char to be signed. Each
+// kernel names its instruction set in a target attribute, i386 builds do not
+// enable even SSE2.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(__CHAR_UNSIGNED__)
+#define HASHSIMD
+#include <immintrin.h>
+#endif
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
+#endif
 
 #define MINPRIME 101
 #define MAXPRIME 1009
+
+// Segment helpers shared by FileSys and FileSysSnapshot
+static int numSegments(int cap) {
+    return (cap + SEGMENTSLOTS - 1) / SEGMENTSLOTS;
+}
+
+// A mapping holding the segments of one slot array, unmapped once they are all released
+struct SlotRegion{
+    std::atomic<int> m_live;    // segments not yet released
+    void*      m_base;
+    size_t     m_bytes;
+    page_t     m_pages;         // pages actually backing the mapping
+};
+
+#if defined(__linux__)
+// Whether THP can back a madvised mapping, not when the kernel has it set to never
+static bool thpEnabled() {
+    std::ifstream in("/sys/kernel/mm/transparent_hugepage/enabled");
+    string setting;
+    return std::getline(in, setting) && setting.find("[never]") == string::npos;
+}
+
+// One CPU of every NUMA node this process may allocate from, empty if unknown
+static vector<int> nodeCpus() {
+    vector<int> cpus;
+#if defined(SYS_get_mempolicy)
+    unsigned long nodes[16] = {0};
+    const int BITS = sizeof(unsigned long) * 8;
+    int mode;
+    if (syscall(SYS_get_mempolicy, &mode, nodes, sizeof(nodes) * 8, nullptr, MPOL_F_MEMS_ALLOWED) != 0) {
+        return cpus;
+    }
+    for (int node = 0; node < 16 * BITS; ++node) {
+        if ((nodes[node / BITS] >> (node % BITS)) & 1) {
+            // Nodes without CPUs (memory only) cannot be reached by first touch
+            std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            int cpu;
+            if (in >> cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+#endif
+    return cpus;
+}
+
+// Map zeroed memory for a slot array of bytes, nullptr if mmap fails
+static SlotRegion* mapRegion(size_t bytes, page_t pages, numa_t numa) {
+    bytes = (bytes + HUGEPAGE - 1) / HUGEPAGE * HUGEPAGE;
+    page_t backing = pages;
+    char* base = static_cast<char*>(MAP_FAILED);
+    if (pages == PAGEHUGETLB) {
+        base = static_cast<char*>(mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0));
+        if (base == MAP_FAILED) {
+            backing = PAGETHP; // No huge pages reserved
+        }
+    }
+    if (base == MAP_FAILED) {
+        // Map one huge page extra and trim it so the array starts on a huge page boundary
+        char* raw = static_cast<char*>(mmap(nullptr, bytes + HUGEPAGE, PROT_READ | PROT_WRITE,
+                                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (raw == MAP_FAILED) {
+            return nullptr;
+        }
+        base = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(raw) + HUGEPAGE - 1) / HUGEPAGE * HUGEPAGE);
+        if (base > raw) {
+            munmap(raw, base - raw);
+        }
+        munmap(base + bytes, raw + HUGEPAGE - base);
+        if (backing == PAGETHP && (madvise(base, bytes, MADV_HUGEPAGE) != 0 || !thpEnabled())) {
+            backing = PAGEDEFAULT; // THP unavailable, base pages back the mapping
+        }
+    }
+#if defined(SYS_mbind) && defined(SYS_get_mempolicy)
+    if (numa == NUMAINTERLEAVE) {
+        // Interleave pages over the nodes this process may allocate from
+        unsigned long nodes[16] = {0};
+        int mode;
+        if (syscall(SYS_get_mempolicy, &mode, nodes, sizeof(nodes) * 8, nullptr, MPOL_F_MEMS_ALLOWED) == 0) {
+            syscall(SYS_mbind, base, bytes, MPOL_INTERLEAVE, nodes, sizeof(nodes) * 8, 0);
+        }
+    }
+#endif
+    if (numa == NUMAFIRSTTOUCH) {
+        // One thread per node, pinned to a CPU of that node, zeroes a contiguous
+        // run of huge pages, the kernel places each page on the node of the
+        // thread touching it first
+        vector<int> cpus = nodeCpus();
+        if (cpus.empty()) {
+            cpus.push_back(-1); // Nodes unknown, touch from an unpinned thread
+        }
+        size_t chunks = bytes / HUGEPAGE;
+        size_t threads = cpus.size();
+        vector<std::thread> workers;
+        for (size_t t = 0; t < threads; ++t) {
+            workers.push_back(std::thread([=]() {
+                if (cpus[t] >= 0) {
+                    cpu_set_t set;
+                    CPU_ZERO(&set);
+                    CPU_SET(cpus[t], &set);
+                    sched_setaffinity(0, sizeof(set), &set); // This thread only
+                }
+                for (size_t c = t * chunks / threads; c < (t + 1) * chunks / threads; ++c) {
+                    memset(base + c * HUGEPAGE, 0, HUGEPAGE);
+                }
+            }));
+        }
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+    SlotRegion* region = new SlotRegion();
+    region->m_base = base;
+    region->m_bytes = bytes;
+    region->m_pages = backing;
+    return region;
+}
+#else
+static SlotRegion* mapRegion(size_t, page_t, numa_t) {
+    return nullptr;
+}
+#endif
+
+static Segment** allocSegments(int cap, page_t pages = PAGEDEFAULT, numa_t numa = NUMANONE) {
+    Segment** segments = new Segment*[numSegments(cap)];
+    size_t bytes = numSegments(cap) * sizeof(Segment);
+    SlotRegion* region = nullptr;
+    if ((pages != PAGEDEFAULT || numa != NUMANONE) && bytes >= HUGEPAGE) {
+        region = mapRegion(bytes, pages, numa);
+    }
+    if (region != nullptr) {
+        region->m_live.store(numSegments(cap), std::memory_order_relaxed);
+    }
+    for (int s = 0; s < numSegments(cap); ++s) {
+        if (region != nullptr) {
+            segments[s] = new (static_cast<char*>(region->m_base) + s * sizeof(Segment)) Segment();
+        } else {
+            segments[s] = new Segment();
+        }
+        segments[s]->m_refs.store(1, std::memory_order_relaxed);
+        segments[s]->m_region = region;
+    }
+    return segments;
+}
+
+// Drop one reference, the last holder deletes the segment and its files
+static void releaseSegment(Segment* segment) {
+    if (segment->m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        for (int j = 0; j < SEGMENTSLOTS; ++j) {
+            if (segment->m_slots[j] != reinterpret_cast<File*>(-1)) { // Tombstones are not allocated
+                delete segment->m_slots[j];
+            }
+        }
+        SlotRegion* region = segment->m_region;
+        if (region == nullptr) {
+            delete segment;
+        } else if (region->m_live.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+#if defined(__linux__)
+            munmap(region->m_base, region->m_bytes);
+#endif
+            delete region;
+        }
+    }
+}
+
+static void releaseSegments(Segment** segments, int cap) {
+    for (int s = 0; s < numSegments(cap); ++s) {
+        releaseSegment(segments[s]);
+    }
+    delete[] segments;
+}
+
+static void dumpSegments(Segment** segments, int cap) {
+    for (int i = 0; i < cap; i++) {
+        File* file = segments[i / SEGMENTSLOTS]->m_slots[i % SEGMENTSLOTS];
+        if (file == reinterpret_cast<File*>(-1)) {
+            std::cout << "[" << i << "] : Deleted" << std::endl;
+        } else if (file) {
+            std::cout << "[" << i << "] : " << file->getName() << ", Block: " << file->getDiskBlock() << std::endl;
+        } else {
+            std::cout << "[" << i << "] : Empty" << std::endl;
+        }
+    }
+}
+
 // Constructor
 FileSys::FileSys(int size, hash_fn hash, prob_t probing) 
-    : m_currentCap(size), m_hash(hash), m_probeType(probing), m_currentSize(0), m_oldTable(nullptr), m_oldCap(0) {
-    m_currentTable = new File*[m_currentCap]();
+    : m_currentCap(size), m_hash(hash), m_probeType(probing), m_currentSize(0), m_oldTable(nullptr), m_oldCap(0),
+      m_filter(nullptr), m_filterFpr(DEFFILTERFPR), m_filterBudget(DEFFILTERBYTES), m_filterStale(0),
+      m_filterLookups(0), m_filterRejected(0), m_filterFalsePos(0),
+      m_cacheMax(0), m_onEvict(nullptr), m_evictContext(nullptr), m_refBits(nullptr), m_clockHand(0), m_numEvictions(0),
+      m_index(nullptr), m_trace(nullptr), m_pages(PAGEDEFAULT), m_numa(NUMANONE), m_frozen(nullptr),
+      m_batchHash(nullptr), m_digests(nullptr) {
+    m_currNumDeleted = 0;
+    m_currentTable = allocSegments(m_currentCap);
 }
 
 // Destructor
 FileSys::~FileSys() {
-    for (int i = 0; i < m_currentCap; ++i) {
-        delete m_currentTable[i];
+    // Segments still shared with snapshots stay alive until those are deleted
+    if (m_currentTable != nullptr) {
+        releaseSegments(m_currentTable, m_currentCap);
     }
-    delete[] m_currentTable;
+    delete m_frozen;
 
     // Clean up old table if it exists
     if (m_oldTable != nullptr) {
         for (int i = 0; i < m_oldCap; ++i) {
-            delete m_oldTable[i];
+            if (m_oldTable[i] != reinterpret_cast<File*>(-1)) {
+                delete m_oldTable[i];
+            }
         }
         delete[] m_oldTable;
     }
+    delete m_filter;
+    delete[] m_refBits;
+    delete m_index;
+    delete m_digests;
+    delete m_trace;
 }
 
 // Change the probing policy
@@ -35,34 +253,115 @@ void FileSys::changeProbPolicy(prob_t policy) {
 
 // Insert a file into the table
 bool FileSys::insert(File file) {
+    checkMutable();
+    return insertHashed(file, m_hash(file.getName()));
+}
+
+// Insert many files, hashing their names in batches
+int FileSys::insertBatch(const File* files, int count) {
+    checkMutable();
+    const string* batchNames[HASHBATCH];
+    unsigned int hashes[HASHBATCH];
+    int inserted = 0;
+    for (int first = 0; first < count; first += HASHBATCH) {
+        int batch = std::min(HASHBATCH, count - first);
+        for (int i = 0; i < batch; ++i) {
+            batchNames[i] = &files[first + i].m_name;
+        }
+        hashNames(batchNames, batch, hashes);
+        for (int i = 0; i < batch; ++i) {
+            inserted += insertHashed(files[first + i], hashes[i]);
+        }
+    }
+    return inserted;
+}
+
+void FileSys::setBatchHash(batch_hash_fn batch) {
+    m_batchHash = batch;
+}
+
+// Hash names with the batch function if there is one, else one at a time
+void FileSys::hashNames(const string* const* names, int count, unsigned int* hashes) const {
+    if (m_batchHash != nullptr) {
+        m_batchHash(names, count, hashes);
+        return;
+    }
+    for (int i = 0; i < count; ++i) {
+        hashes[i] = m_hash(*names[i]);
+    }
+}
+
+// Inserts with the name's hash computed by the caller
+bool FileSys::insertHashed(const File& file, unsigned int hash) {
+    if (m_trace != nullptr) {
+        m_trace->write(TRACEINSERT, file.getName(), file.getDiskBlock());
+    }
 
     if (m_currentSize == m_currentCap) {
         return false; // Table full
     }
 
-    // Trigger rehashing if load factor exceeds threshold
-    if (lambda() > 0.75) {
+    if (isCacheMode()) {
+        // Purge tombstones in place since the table no longer grows
+        if (m_currNumDeleted > m_currentCap / 4) {
+            rehashTo(m_currentCap);
+        }
+    } else if (lambda() > 0.75) {
+        // Trigger rehashing if load factor exceeds threshold
         rehash();
     }
 
-    int index = m_hash(file.getName()) % m_currentCap;
+    int index = hash % m_currentCap;
     int step = 1;
+    int tombstone = -1; // First tombstone seen, reused once no duplicate turns up
 
-    while (m_currentTable[index] != nullptr && m_currentTable[index] != reinterpret_cast<File*>(-1)) {
-        if (m_currentTable[index]->getName() == file.getName() &&
-            m_currentTable[index]->getDiskBlock() == file.getDiskBlock()) {
+    File* slot = slotAt(index);
+    while (slot != nullptr) {
+        if (slot == reinterpret_cast<File*>(-1)) {
+            if (tombstone < 0) {
+                tombstone = index;
+            }
+        } else if (slot->getName() == file.getName() &&
+                   slot->getDiskBlock() == file.getDiskBlock()) {
             return false; // Duplicate entry
         }
 
-        index = (index + step * step) % m_currentCap; // Quadratic probing
+        index = (index + static_cast<long>(step) * step) % m_currentCap; // Quadratic probing
         step++;
         if (step > m_currentCap) {
-            return false; // Probing exhausted
+            if (tombstone < 0) {
+                return false; // Probing exhausted
+            }
+            break;
         }
+        slot = slotAt(index);
+    }
+    if (tombstone >= 0) {
+        index = tombstone;
     }
 
-    m_currentTable[index] = new File(file);
+    // Make room by eviction, the victim is always a live slot so index stays free
+    if (isCacheMode() && m_currentSize >= m_cacheMax) {
+        evictOne();
+    }
+    File*& target = writableSlot(index);
+    if (target == reinterpret_cast<File*>(-1)) {
+        m_currNumDeleted--; // Reusing a tombstone
+    }
+    target = new File(file);
     m_currentSize++;
+    if (m_refBits != nullptr) {
+        m_refBits[index] = 1;
+    }
+    if (m_filter != nullptr) {
+        m_filter->add(file.getName(), file.getDiskBlock());
+    }
+    if (m_index != nullptr) {
+        m_index->insert(file.getName(), file.getDiskBlock());
+    }
+    if (m_digests != nullptr) {
+        m_digests->add(file.getName(), file.getDiskBlock());
+    }
     return true;
 }
 
@@ -70,20 +369,23 @@ bool FileSys::insert(File file) {
 
 // Remove a file from the table
 bool FileSys::remove(File file) {
+    checkMutable();
+    if (m_trace != nullptr) {
+        m_trace->write(TRACEREMOVE, file.getName(), file.getDiskBlock());
+    }
     int index = m_hash(file.getName()) % m_currentCap;
     int step = 1;
 
-    while (m_currentTable[index] != nullptr) {
-        if (m_currentTable[index] != reinterpret_cast<File*>(-1) && // Skip tombstones
-            m_currentTable[index]->getName() == file.getName() &&
-            m_currentTable[index]->getDiskBlock() == file.getDiskBlock()) {
-            delete m_currentTable[index];
-            m_currentTable[index] = reinterpret_cast<File*>(-1); // Mark as tombstone
-            m_currentSize--;
+    File* slot;
+    while ((slot = slotAt(index)) != nullptr) {
+        if (slot != reinterpret_cast<File*>(-1) && // Skip tombstones
+            slot->getName() == file.getName() &&
+            slot->getDiskBlock() == file.getDiskBlock()) {
+            eraseSlot(index);
             return true;
         }
 
-        index = (index + step * step) % m_currentCap; // Quadratic probing
+        index = (index + static_cast<long>(step) * step) % m_currentCap; // Quadratic probing
         step++;
         if (step > m_currentCap) {
             break; // Probing exhausted
@@ -101,56 +403,160 @@ int FileSys::hash(std::string name, int block) const {
 
 // Retrieve a file by name and block
 const File FileSys::getFile(std::string name, int block) const {
-    int index = m_hash(name) % m_currentCap;
+    // The perfect hash of a frozen table does not use the table's hash
+    const File* file = findHashed(name, block, (m_frozen != nullptr) ? 0 : m_hash(name));
+    if (file == nullptr) {
+        throw std::runtime_error("File not found");
+    }
+    return *file;
+}
+
+// Look up many keys, hashing their names in batches
+int FileSys::getFiles(const string* names, const int* blocks, int count, File* files, bool* found) const {
+    const string* batchNames[HASHBATCH];
+    unsigned int hashes[HASHBATCH] = {0}; // Not computed for a frozen table, which hashes by itself
+    int numFound = 0;
+    for (int first = 0; first < count; first += HASHBATCH) {
+        int batch = std::min(HASHBATCH, count - first);
+        for (int i = 0; i < batch; ++i) {
+            batchNames[i] = &names[first + i];
+        }
+        if (m_frozen == nullptr) {
+            hashNames(batchNames, batch, hashes);
+        }
+        for (int i = 0; i < batch; ++i) {
+            const File* file = findHashed(names[first + i], blocks[first + i], hashes[i]);
+            found[first + i] = (file != nullptr);
+            if (file != nullptr) {
+                files[first + i] = *file;
+                numFound++;
+            }
+        }
+    }
+    return numFound;
+}
+
+// Find a file with the name's hash computed by the caller, nullptr if it is not stored
+const File* FileSys::findHashed(const string& name, int block, unsigned int hash) const {
+    if (m_trace != nullptr) {
+        m_trace->write(TRACEGET, name, block);
+    }
+    if (m_filter != nullptr) {
+        m_filterLookups++;
+        if (!m_filter->mayContain(name, block)) {
+            m_filterRejected++;
+            return nullptr;
+        }
+    }
+
+    if (m_frozen != nullptr) {
+        // One slot of the perfect hash holds the file if it is stored at all
+        const File* file = m_frozen->find(name, block);
+        if (file == nullptr && m_filter != nullptr) {
+            m_filterFalsePos++;
+        }
+        return file;
+    }
+
+    int index = hash % m_currentCap;
     int step = 1;
 
-    while (m_currentTable[index] != nullptr) {
-        if (m_currentTable[index] != reinterpret_cast<File*>(-1) &&
-            m_currentTable[index]->getName() == name &&
-            m_currentTable[index]->getDiskBlock() == block) {
-            return *m_currentTable[index];
+    File* slot;
+    while ((slot = slotAt(index)) != nullptr) {
+        if (slot != reinterpret_cast<File*>(-1) &&
+            slot->getName() == name &&
+            slot->getDiskBlock() == block) {
+            if (m_refBits != nullptr) {
+                m_refBits[index] = 1;
+            }
+            return slot;
         }
 
-        index = (index + step * step) % m_currentCap; // Quadratic probing
+        index = (index + static_cast<long>(step) * step) % m_currentCap; // Quadratic probing
         step++;
         if (step > m_currentCap) {
             break; // Probing exhausted
         }
     }
 
-    throw std::runtime_error("File not found");
+    if (m_filter != nullptr) {
+        m_filterFalsePos++;
+    }
+    return nullptr;
 }
 
 
 
 // Update the disk block of a file
 bool FileSys::updateDiskBlock(File file, int block) {
+    checkMutable();
+    if (m_trace != nullptr) {
+        m_trace->write(TRACEUPDATE, file.getName(), file.getDiskBlock(), block);
+    }
     int index = m_hash(file.getName()) % m_currentCap;
     int step = 1;
+    int found = -1;
 
-    while (m_currentTable[index]) {
-        if (m_currentTable[index]->getName() == file.getName() &&
-            m_currentTable[index]->getDiskBlock() == file.getDiskBlock()) {
-            m_currentTable[index]->setDiskBlock(block);
-            return true;
+    // Both blocks of the name share its probe sequence, walk all of it so an
+    // update onto a (name, block) already stored is refused
+    File* slot;
+    while ((slot = slotAt(index)) != nullptr) {
+        if (slot != reinterpret_cast<File*>(-1) && // Skip tombstones
+            slot->getName() == file.getName()) {
+            if (slot->getDiskBlock() == file.getDiskBlock()) {
+                found = index;
+            } else if (slot->getDiskBlock() == block) {
+                return false; // Would duplicate an entry
+            }
         }
-        index = (index + step * step) % m_currentCap;
+        index = (index + static_cast<long>(step) * step) % m_currentCap; // Quadratic probing
         step++;
+        if (step > m_currentCap) {
+            break; // Probing exhausted
+        }
     }
 
-    return false; // File not found
+    if (found == -1) {
+        return false; // File not found
+    }
+    writableSlot(found)->setDiskBlock(block); // may be a private copy of slot
+    if (m_index != nullptr) {
+        m_index->remove(file.getName(), file.getDiskBlock());
+        m_index->insert(file.getName(), block);
+    }
+    if (m_digests != nullptr) {
+        m_digests->remove(file.getName(), file.getDiskBlock());
+        m_digests->add(file.getName(), block);
+    }
+    if (m_refBits != nullptr) {
+        m_refBits[found] = 1;
+    }
+    if (m_filter != nullptr) {
+        m_filter->add(file.getName(), block);
+        // the old (name, block) key stays set
+        if (++m_filterStale > m_filter->capacity() / 2) {
+            rebuildFilter();
+        }
+    }
+    return true;
 }
 
 // Calculate the load factor
 float FileSys::lambda() const {
+    if (m_frozen != nullptr) {
+        return 1; // Every slot of the perfect hash holds a file
+    }
     return static_cast<float>(m_currentSize) / m_currentCap;
 }
 
 // Calculate the deleted ratio
 float FileSys::deletedRatio() const {
+    if (m_frozen != nullptr) {
+        return 0;
+    }
     int deletedCount = 0;
     for (int i = 0; i < m_currentCap; ++i) {
-        if (m_currentTable[i] == nullptr) {
+        if (slotAt(i) == nullptr) {
             deletedCount++;
         }
     }
@@ -161,12 +567,11 @@ float FileSys::deletedRatio() const {
 void FileSys::dump() const {
     std::cout << "Dump for the current table: " << std::endl;
     if (m_currentTable != nullptr) {
-        for (int i = 0; i < m_currentCap; i++) {
-            if (m_currentTable[i]) {
-                std::cout << "[" << i << "] : " << m_currentTable[i]->getName() << ", Block: " << m_currentTable[i]->getDiskBlock() << std::endl;
-            } else {
-                std::cout << "[" << i << "] : Empty" << std::endl;
-            }
+        dumpSegments(m_currentTable, m_currentCap);
+    }
+    if (m_frozen != nullptr) {
+        for (int i = 0; i < m_frozen->size(); i++) {
+            std::cout << "[" << i << "] : " << m_frozen->fileAt(i)->getName() << ", Block: " << m_frozen->fileAt(i)->getDiskBlock() << std::endl;
         }
     }
 
@@ -206,30 +611,1749 @@ int FileSys::findNextPrime(int current) {
 
 void FileSys::rehash() {
     int newCap = findNextPrime(m_currentCap * 2); // Double the capacity and find next prime
-    File** newTable = new File*[newCap]();
+    // At MAXPRIME the table cannot grow, rebuilding it only helps to drop tombstones
+    if (newCap <= m_currentCap && m_currNumDeleted == 0) {
+        return;
+    }
+    rehashTo(newCap);
+}
+
+// Move every live file into a table of newCap slots. The probe sequence does
+// not reach every slot, so a crowded table may leave a file with nowhere to go,
+// in that case nothing changes and false is returned.
+bool FileSys::rehashTo(int newCap) {
+    Segment** newTable = allocSegments(newCap, m_pages, m_numa);
+    unsigned char* newRefBits = (m_refBits != nullptr) ? new unsigned char[newCap]() : nullptr;
 
     // Save the old table for dumping
-    File** oldTable = m_currentTable;
+    Segment** oldTable = m_currentTable;
     int oldCap = m_currentCap;
 
-    // Rehash all non-null, non-tombstone entries
-    for (int i = 0; i < oldCap; ++i) {
-        if (oldTable[i] != nullptr && oldTable[i] != reinterpret_cast<File*>(-1)) {
-            int index = m_hash(oldTable[i]->getName()) % newCap;
-            int step = 1;
+    // Whether each old segment is shared with a snapshot, read once so copying
+    // and releasing agree even if a snapshot is deleted meanwhile
+    std::vector<bool> shared(numSegments(oldCap));
+    for (int s = 0; s < numSegments(oldCap); ++s) {
+        shared[s] = oldTable[s]->m_refs.load(std::memory_order_acquire) > 1;
+    }
 
-            while (newTable[index] != nullptr) {
-                index = (index + step * step) % newCap;
-                step++;
+    // Gather all non-null, non-tombstone entries and hash their names together
+    std::vector<int> from;
+    std::vector<const string*> names;
+    for (int s = 0; s < numSegments(oldCap); ++s) {
+        int end = std::min(SEGMENTSLOTS, oldCap - s * SEGMENTSLOTS);
+        for (int j = 0; j < end; ++j) {
+            File* file = oldTable[s]->m_slots[j];
+            if (file != nullptr && file != reinterpret_cast<File*>(-1)) {
+                from.push_back(s * SEGMENTSLOTS + j);
+                names.push_back(&file->m_name);
+            }
+        }
+    }
+    std::vector<unsigned int> hashes(from.size());
+    hashNames(names.data(), static_cast<int>(names.size()), hashes.data());
+
+    // Place them, remembering the ones that come from segments shared with a
+    // snapshot since those must be copied
+    std::vector<int> fromShared;
+    bool placed = true;
+    for (size_t k = 0; k < from.size(); ++k) {
+        File* file = oldTable[from[k] / SEGMENTSLOTS]->m_slots[from[k] % SEGMENTSLOTS];
+        int index = hashes[k] % newCap;
+        int step = 1;
+
+        File** slot;
+        while (*(slot = &newTable[index / SEGMENTSLOTS]->m_slots[index % SEGMENTSLOTS]) != nullptr) {
+            if (step > newCap) {
+                break; // Probing exhausted
+            }
+            index = (index + static_cast<long>(step) * step) % newCap;
+            step++;
+        }
+        if (*slot != nullptr) {
+            placed = false;
+            break;
+        }
+        *slot = file;
+        if (shared[from[k] / SEGMENTSLOTS]) {
+            fromShared.push_back(index);
+        }
+        if (newRefBits != nullptr) {
+            newRefBits[index] = m_refBits[from[k]];
+        }
+    }
+
+    if (!placed) {
+        // The new table only borrowed pointers, free it without the files
+        for (int s = 0; s < numSegments(newCap); ++s) {
+            std::fill(newTable[s]->m_slots, newTable[s]->m_slots + SEGMENTSLOTS, nullptr);
+        }
+        releaseSegments(newTable, newCap);
+        delete[] newRefBits;
+        return false;
+    }
+
+    // A snapshot keeps the originals of shared segments, the table takes copies
+    for (int index : fromShared) {
+        File*& slot = newTable[index / SEGMENTSLOTS]->m_slots[index % SEGMENTSLOTS];
+        slot = new File(*slot);
+    }
+    // Files of unshared segments moved, they are not released with the segment
+    for (int s = 0; s < numSegments(oldCap); ++s) {
+        if (shared[s]) {
+            continue;
+        }
+        Segment* segment = oldTable[s];
+        for (int j = 0; j < SEGMENTSLOTS; ++j) {
+            if (segment->m_slots[j] != reinterpret_cast<File*>(-1)) {
+                segment->m_slots[j] = nullptr;
             }
-            newTable[index] = oldTable[i];
         }
     }
 
     // Clean up the old table
-    delete[] oldTable;
+    releaseSegments(oldTable, oldCap);
+    delete[] m_refBits;
 
     // Update to the new table
     m_currentTable = newTable;
     m_currentCap = newCap;
+    m_currNumDeleted = 0;
+    m_refBits = newRefBits;
+    m_clockHand = 0;
+
+    // Size the filter for the new capacity, this also drops stale keys
+    if (m_filter != nullptr) {
+        rebuildFilter();
+    }
+    return true;
+}
+
+File*& FileSys::writableSlot(int index) {
+    Segment*& segment = m_currentTable[index / SEGMENTSLOTS];
+    if (segment->m_refs.load(std::memory_order_acquire) > 1) {
+        // A snapshot shares this segment, give the table its own copy
+        Segment* copy = new Segment();
+        copy->m_refs.store(1, std::memory_order_relaxed);
+        for (int j = 0; j < SEGMENTSLOTS; ++j) {
+            File* file = segment->m_slots[j];
+            copy->m_slots[j] = (file == nullptr || file == reinterpret_cast<File*>(-1)) ? file : new File(*file);
+        }
+        releaseSegment(segment);
+        segment = copy;
+    }
+    return segment->m_slots[index % SEGMENTSLOTS];
+}
+
+FileSysSnapshot* FileSys::snapshot() {
+    checkMutable();
+    Segment** segments = new Segment*[numSegments(m_currentCap)];
+    for (int s = 0; s < numSegments(m_currentCap); ++s) {
+        segments[s] = m_currentTable[s];
+        segments[s]->m_refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    return new FileSysSnapshot(segments, m_currentCap, m_currentSize, m_hash);
+}
+
+// Delete the file at index and leave a tombstone in its slot
+void FileSys::eraseSlot(int index) {
+    File*& slot = writableSlot(index);
+    if (m_index != nullptr) {
+        m_index->remove(slot->getName(), slot->getDiskBlock());
+    }
+    if (m_digests != nullptr) {
+        m_digests->remove(slot->getName(), slot->getDiskBlock());
+    }
+    delete slot;
+    slot = reinterpret_cast<File*>(-1); // Mark as tombstone
+    m_currentSize--;
+    m_currNumDeleted++;
+    // The filter cannot forget a key, rebuild it before stale keys degrade its rate
+    if (m_filter != nullptr && ++m_filterStale > m_filter->capacity() / 2) {
+        rebuildFilter();
+    }
+}
+
+// Switch to a fixed-capacity table that evicts instead of failing when full
+void FileSys::enableCacheMode(int maxEntries, evict_fn onEvict, void* context) {
+    checkMutable();
+    if (maxEntries < 1) {
+        throw std::invalid_argument("Cache mode needs room for at least one file");
+    }
+    m_cacheMax = maxEntries;
+    m_onEvict = onEvict;
+    m_evictContext = context;
+    // Evict down to the bound before shrinking the table
+    if (m_refBits == nullptr) {
+        m_refBits = new unsigned char[m_currentCap]();
+    }
+    while (m_currentSize > m_cacheMax) {
+        evictOne();
+    }
+    // Keep the load at most 1/2 so probe chains stay short without growing,
+    // the capacity is not bounded by MAXPRIME here
+    int newCap = 2 * maxEntries + 1;
+    while (!isPrime(newCap)) {
+        newCap++;
+    }
+    // If the files cannot all be placed, spread them over a larger table
+    while (!rehashTo(newCap)) {
+        newCap = 2 * newCap + 1;
+        while (!isPrime(newCap)) {
+            newCap++;
+        }
+    }
+}
+
+// Evict the first file the CLOCK hand finds with a clear reference bit,
+// clearing the bits it passes over (second chance)
+void FileSys::evictOne() {
+    if (m_currentSize == 0) {
+        return;
+    }
+    while (true) {
+        int index = m_clockHand;
+        m_clockHand = (m_clockHand + 1) % m_currentCap;
+        File* file = slotAt(index);
+        if (file == nullptr || file == reinterpret_cast<File*>(-1)) {
+            continue;
+        }
+        if (m_refBits[index]) {
+            m_refBits[index] = 0;
+            continue;
+        }
+        if (m_onEvict != nullptr) {
+            m_onEvict(*file, m_evictContext);
+        }
+        eraseSlot(index);
+        m_numEvictions++;
+        return;
+    }
+}
+
+// Build the ordered index from the current table, it is kept in sync from here on
+void FileSys::enableOrderedIndex() {
+    if (m_index != nullptr) {
+        return;
+    }
+    m_index = new NameIndex();
+    if (m_frozen != nullptr) {
+        for (int i = 0; i < m_frozen->size(); ++i) {
+            m_index->insert(m_frozen->fileAt(i)->getName(), m_frozen->fileAt(i)->getDiskBlock());
+        }
+        return;
+    }
+    for (int i = 0; i < m_currentCap; ++i) {
+        File* slot = slotAt(i);
+        if (slot != nullptr && slot != reinterpret_cast<File*>(-1)) {
+            m_index->insert(slot->getName(), slot->getDiskBlock());
+        }
+    }
+}
+
+void FileSys::disableOrderedIndex() {
+    delete m_index;
+    m_index = nullptr;
+}
+
+NameIndex::Iterator FileSys::listPrefix(const string& prefix) const {
+    if (m_index == nullptr) {
+        throw std::logic_error("Ordered index is not enabled");
+    }
+    return m_index->listPrefix(prefix);
+}
+
+NameIndex::Iterator FileSys::listRange(const string& lo, const string& hi) const {
+    if (m_index == nullptr) {
+        throw std::logic_error("Ordered index is not enabled");
+    }
+    return m_index->listRange(lo, hi);
+}
+
+void FileSys::enableDigests() {
+    if (m_digests != nullptr) {
+        return;
+    }
+    m_digests = new DigestTree();
+    if (m_frozen != nullptr) {
+        for (int i = 0; i < m_frozen->size(); ++i) {
+            m_digests->add(m_frozen->fileAt(i)->getName(), m_frozen->fileAt(i)->getDiskBlock());
+        }
+        return;
+    }
+    for (int i = 0; i < m_currentCap; ++i) {
+        File* slot = slotAt(i);
+        if (slot != nullptr && slot != reinterpret_cast<File*>(-1)) {
+            m_digests->add(slot->getName(), slot->getDiskBlock());
+        }
+    }
+}
+
+void FileSys::disableDigests() {
+    delete m_digests;
+    m_digests = nullptr;
+}
+
+const DigestTree& FileSys::digests() const {
+    if (m_digests == nullptr) {
+        throw std::logic_error("Digests are not enabled");
+    }
+    return *m_digests;
+}
+
+void FileSys::diff(const FileSys& other, vector<File>& onlyHere, vector<File>& onlyThere) const {
+    vector<int> ranges = digests().diffRanges(other.digests());
+    DigestTree::diffEntries(m_digests->entries(ranges), other.m_digests->entries(ranges), onlyHere, onlyThere);
+}
+
+bool FileSys::startTrace(const string& path) {
+    stopTrace();
+    m_trace = new TraceWriter(path);
+    if (!m_trace->good()) {
+        stopTrace();
+        return false;
+    }
+    return true;
+}
+
+void FileSys::stopTrace() {
+    delete m_trace; // flushes and closes the file
+    m_trace = nullptr;
+}
+
+void FileSys::setAllocPolicy(page_t pages, numa_t numa) {
+    m_pages = pages;
+    m_numa = numa;
+    if (m_frozen == nullptr) {
+        rehashTo(m_currentCap); // If the files do not fit again the policy waits for the next rehash
+    }
+}
+
+page_t FileSys::tablePages() const {
+    if (m_frozen != nullptr) {
+        return PAGEDEFAULT;
+    }
+    // Segments copied for snapshots live on the heap, look for one still in the mapping
+    for (int s = 0; s < numSegments(m_currentCap); ++s) {
+        if (m_currentTable[s]->m_region != nullptr) {
+            return m_currentTable[s]->m_region->m_pages;
+        }
+    }
+    return PAGEDEFAULT;
+}
+
+void FileSys::checkMutable() const {
+    if (m_frozen != nullptr) {
+        throw std::logic_error("FileSys is frozen");
+    }
+}
+
+bool FileSys::freeze() {
+    if (m_frozen != nullptr) {
+        return true;
+    }
+    vector<const File*> files;
+    files.reserve(m_currentSize);
+    for (int i = 0; i < m_currentCap; ++i) {
+        File* slot = slotAt(i);
+        if (slot != nullptr && slot != reinterpret_cast<File*>(-1)) {
+            files.push_back(slot);
+        }
+    }
+    PerfectHash* frozen = new PerfectHash();
+    if (!frozen->build(files)) {
+        delete frozen;
+        return false;
+    }
+    // The perfect hash holds copies, snapshots keep the segments they share
+    releaseSegments(m_currentTable, m_currentCap);
+    m_currentTable = nullptr;
+    m_currNumDeleted = 0;
+    delete[] m_refBits;
+    m_refBits = nullptr;
+    m_clockHand = 0;
+    m_frozen = frozen;
+    return true;
+}
+
+void FileSys::thaw() {
+    if (m_frozen == nullptr) {
+        return;
+    }
+    std::vector<const string*> names(m_frozen->size());
+    for (int i = 0; i < m_frozen->size(); ++i) {
+        names[i] = &m_frozen->fileAt(i)->m_name;
+    }
+    std::vector<unsigned int> hashes(names.size());
+    hashNames(names.data(), m_frozen->size(), hashes.data());
+
+    int cap = m_currentCap;
+    while (true) {
+        Segment** table = allocSegments(cap, m_pages, m_numa);
+        bool placed = true;
+        for (int i = 0; i < m_frozen->size() && placed; ++i) {
+            const File* file = m_frozen->fileAt(i);
+            int index = hashes[i] % cap;
+            int step = 1;
+
+            File** slot;
+            while (*(slot = &table[index / SEGMENTSLOTS]->m_slots[index % SEGMENTSLOTS]) != nullptr) {
+                if (step > cap) {
+                    placed = false; // Probing exhausted
+                    break;
+                }
+                index = (index + static_cast<long>(step) * step) % cap;
+                step++;
+            }
+            if (placed) {
+                *slot = new File(*file);
+            }
+        }
+        if (placed) {
+            m_currentTable = table;
+            m_currentCap = cap;
+            break;
+        }
+        // Spread the files over a larger table, the copies placed so far go with this one
+        releaseSegments(table, cap);
+        cap = 2 * cap + 1;
+        while (!isPrime(cap)) {
+            cap++;
+        }
+    }
+    if (isCacheMode()) {
+        m_refBits = new unsigned char[m_currentCap]();
+    }
+    delete m_frozen;
+    m_frozen = nullptr;
+}
+
+// Enable (or resize) the negative-lookup filter
+void FileSys::enableMissFilter(float fpRate, int maxBytes) {
+    if (fpRate <= 0 || fpRate >= 1) {
+        throw std::invalid_argument("Filter false-positive rate must be in (0, 1)");
+    }
+    m_filterFpr = fpRate;
+    m_filterBudget = maxBytes;
+    m_filterLookups = m_filterRejected = m_filterFalsePos = 0;
+    rebuildFilter();
+}
+
+void FileSys::disableMissFilter() {
+    delete m_filter;
+    m_filter = nullptr;
+    m_filterStale = 0;
+}
+
+FilterStats FileSys::filterStats() const {
+    FilterStats stats;
+    stats.enabled = (m_filter != nullptr);
+    stats.budget = m_filterBudget;
+    stats.targetFpr = m_filterFpr;
+    if (m_filter != nullptr) {
+        stats.bytes = m_filter->bytes();
+        stats.numHashes = m_filter->numHashes();
+        stats.expectedFpr = m_filter->expectedFpr();
+        stats.lookups = m_filterLookups;
+        stats.rejected = m_filterRejected;
+        stats.falsePositives = m_filterFalsePos;
+        stats.staleKeys = m_filterStale;
+    }
+    return stats;
+}
+
+// Rebuild the filter from the live entries of the current table
+void FileSys::rebuildFilter() {
+    // Size for the most keys the table holds before the next rehash
+    int expected = static_cast<int>(m_currentCap * 0.75) + 1;
+    delete m_filter;
+    m_filter = new MissFilter(expected, m_filterFpr, m_filterBudget);
+    if (m_frozen != nullptr) {
+        for (int i = 0; i < m_frozen->size(); ++i) {
+            m_filter->add(m_frozen->fileAt(i)->getName(), m_frozen->fileAt(i)->getDiskBlock());
+        }
+    } else {
+        for (int i = 0; i < m_currentCap; ++i) {
+            File* slot = slotAt(i);
+            if (slot != nullptr && slot != reinterpret_cast<File*>(-1)) {
+                m_filter->add(slot->getName(), slot->getDiskBlock());
+            }
+        }
+    }
+    m_filterStale = 0;
+}
+
+// NameIndex
+// First 8 bytes of name, big-endian and zero padded, so prefixes order like the names
+static uint64_t namePrefix(const string& name) {
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < 8; ++i) {
+        prefix = (prefix << 8) | (i < name.size() ? static_cast<unsigned char>(name[i]) : 0);
+    }
+    return prefix;
+}
+
+// Compare (name, block) with key i of node, the prefix decides unless it ties
+static int compareKey(uint64_t prefix, const string& name, int block, const IndexNode* node, int i) {
+    if (prefix != node->m_prefixes[i]) {
+        return prefix < node->m_prefixes[i] ? -1 : 1;
+    }
+    int order = name.compare(node->m_names[i]);
+    if (order != 0) {
+        return order;
+    }
+    return (block > node->m_blocks[i]) - (block < node->m_blocks[i]);
+}
+
+// Number of keys of node below (name, block)
+static int lowerIndex(const IndexNode* node, uint64_t prefix, const string& name, int block) {
+    int lo = 0, hi = node->m_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (compareKey(prefix, name, block, node, mid) > 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Number of keys of node not above (name, block), the child to descend into
+static int upperIndex(const IndexNode* node, uint64_t prefix, const string& name, int block) {
+    int lo = 0, hi = node->m_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (compareKey(prefix, name, block, node, mid) >= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static IndexNode* newIndexNode(bool leaf) {
+    IndexNode* node = new IndexNode();
+    node->m_leaf = leaf;
+    return node;
+}
+
+static void moveKey(IndexNode* from, int i, IndexNode* to, int j) {
+    to->m_prefixes[j] = from->m_prefixes[i];
+    to->m_names[j] = std::move(from->m_names[i]);
+    to->m_blocks[j] = from->m_blocks[i];
+}
+
+// Insert the key at position pos of node, shifting the keys after it
+static void insertKey(IndexNode* node, int pos, uint64_t prefix, const string& name, int block) {
+    for (int i = node->m_count; i > pos; --i) {
+        moveKey(node, i - 1, node, i);
+    }
+    node->m_prefixes[pos] = prefix;
+    node->m_names[pos] = name;
+    node->m_blocks[pos] = block;
+    node->m_count++;
+}
+
+NameIndex::NameIndex() : m_root(nullptr), m_firstLeaf(nullptr), m_size(0), m_numLeaves(0) {}
+
+NameIndex::~NameIndex() {
+    destroy(m_root);
+}
+
+void NameIndex::destroy(IndexNode* node) {
+    if (node == nullptr) {
+        return;
+    }
+    if (!node->m_leaf) {
+        for (int i = 0; i <= node->m_count; ++i) {
+            destroy(node->m_children[i]);
+        }
+    }
+    delete node;
+}
+
+bool NameIndex::insert(const string& name, int block) {
+    uint64_t prefix = namePrefix(name);
+    if (m_root == nullptr) {
+        m_root = m_firstLeaf = newIndexNode(true);
+        m_numLeaves = 1;
+    }
+
+    // Descend, remembering the path for splits
+    IndexNode* path[64];
+    int route[64];
+    int depth = 0;
+    IndexNode* node = m_root;
+    while (!node->m_leaf) {
+        int child = upperIndex(node, prefix, name, block);
+        path[depth] = node;
+        route[depth] = child;
+        depth++;
+        node = node->m_children[child];
+    }
+    int pos = lowerIndex(node, prefix, name, block);
+    if (pos < node->m_count && compareKey(prefix, name, block, node, pos) == 0) {
+        return false; // Duplicate entry
+    }
+    insertKey(node, pos, prefix, name, block);
+    m_size++;
+    if (node->m_count < INDEXORDER) {
+        return true;
+    }
+
+    // Split the full leaf, its right half starts with the new separator
+    IndexNode* right = newIndexNode(true);
+    int keep = INDEXORDER / 2;
+    for (int i = keep; i < INDEXORDER; ++i) {
+        moveKey(node, i, right, i - keep);
+    }
+    right->m_count = INDEXORDER - keep;
+    node->m_count = keep;
+    right->m_next = node->m_next;
+    node->m_next = right;
+    m_numLeaves++;
+    uint64_t sepPrefix = right->m_prefixes[0];
+    string sepName = right->m_names[0];
+    int sepBlock = right->m_blocks[0];
+    IndexNode* newChild = right;
+
+    // Add the separator to the parent, splitting full parents on the way up
+    while (depth > 0) {
+        depth--;
+        IndexNode* parent = path[depth];
+        int at = route[depth];
+        insertKey(parent, at, sepPrefix, sepName, sepBlock);
+        for (int i = parent->m_count; i > at + 1; --i) {
+            parent->m_children[i] = parent->m_children[i - 1];
+        }
+        parent->m_children[at + 1] = newChild;
+        if (parent->m_count < INDEXORDER) {
+            return true;
+        }
+
+        // The middle key moves up, the keys right of it go to a new sibling
+        IndexNode* sibling = newIndexNode(false);
+        int mid = INDEXORDER / 2;
+        sepPrefix = parent->m_prefixes[mid];
+        sepName = std::move(parent->m_names[mid]);
+        sepBlock = parent->m_blocks[mid];
+        for (int i = mid + 1; i < INDEXORDER; ++i) {
+            moveKey(parent, i, sibling, i - mid - 1);
+        }
+        for (int i = mid + 1; i <= INDEXORDER; ++i) {
+            sibling->m_children[i - mid - 1] = parent->m_children[i];
+        }
+        sibling->m_count = INDEXORDER - mid - 1;
+        parent->m_count = mid;
+        newChild = sibling;
+    }
+
+    // The root split, the tree grows by one level
+    IndexNode* root = newIndexNode(false);
+    root->m_prefixes[0] = sepPrefix;
+    root->m_names[0] = sepName;
+    root->m_blocks[0] = sepBlock;
+    root->m_count = 1;
+    root->m_children[0] = m_root;
+    root->m_children[1] = newChild;
+    m_root = root;
+    return true;
+}
+
+bool NameIndex::remove(const string& name, int block) {
+    if (m_root == nullptr) {
+        return false;
+    }
+    uint64_t prefix = namePrefix(name);
+    IndexNode* node = m_root;
+    while (!node->m_leaf) {
+        node = node->m_children[upperIndex(node, prefix, name, block)];
+    }
+    int pos = lowerIndex(node, prefix, name, block);
+    if (pos == node->m_count || compareKey(prefix, name, block, node, pos) != 0) {
+        return false; // Key not found
+    }
+    for (int i = pos + 1; i < node->m_count; ++i) {
+        moveKey(node, i, node, i - 1);
+    }
+    node->m_count--;
+    node->m_names[node->m_count] = string(); // release the name
+    m_size--;
+
+    // Separators stay valid without rebalancing, rebuild once leaves are mostly empty
+    if (m_numLeaves > 1 && m_size < m_numLeaves * INDEXORDER / 8) {
+        rebuild();
+    }
+    return true;
+}
+
+// Bulk load a tree with leaves 3/4 full from the keys of the leaf chain
+void NameIndex::rebuild() {
+    const int FILL = INDEXORDER * 3 / 4;
+    vector<uint64_t> prefixes;
+    vector<string> names;
+    vector<int> blocks;
+    prefixes.reserve(m_size);
+    names.reserve(m_size);
+    blocks.reserve(m_size);
+    for (IndexNode* leaf = m_firstLeaf; leaf != nullptr; leaf = leaf->m_next) {
+        for (int i = 0; i < leaf->m_count; ++i) {
+            prefixes.push_back(leaf->m_prefixes[i]);
+            names.push_back(std::move(leaf->m_names[i]));
+            blocks.push_back(leaf->m_blocks[i]);
+        }
+    }
+    destroy(m_root);
+    m_root = m_firstLeaf = nullptr;
+    m_numLeaves = 0;
+    int count = static_cast<int>(names.size());
+    if (count == 0) {
+        return;
+    }
+
+    // Each node of a level, with the index of the smallest key below it
+    vector<IndexNode*> level;
+    vector<int> firsts;
+    IndexNode* previous = nullptr;
+    for (int start = 0; start < count; start += FILL) {
+        IndexNode* leaf = newIndexNode(true);
+        int end = std::min(count, start + FILL);
+        for (int i = start; i < end; ++i) {
+            leaf->m_prefixes[i - start] = prefixes[i];
+            leaf->m_names[i - start] = names[i];
+            leaf->m_blocks[i - start] = blocks[i];
+        }
+        leaf->m_count = end - start;
+        if (previous == nullptr) {
+            m_firstLeaf = leaf;
+        } else {
+            previous->m_next = leaf;
+        }
+        previous = leaf;
+        level.push_back(leaf);
+        firsts.push_back(start);
+        m_numLeaves++;
+    }
+    // Internal levels, the separators are the smallest keys of the children after the first
+    while (level.size() > 1) {
+        vector<IndexNode*> upper;
+        vector<int> upperFirsts;
+        for (size_t start = 0; start < level.size(); start += FILL + 1) {
+            IndexNode* node = newIndexNode(false);
+            size_t end = std::min(level.size(), start + FILL + 1);
+            for (size_t i = start; i < end; ++i) {
+                node->m_children[i - start] = level[i];
+                if (i > start) {
+                    int key = firsts[i];
+                    node->m_prefixes[i - start - 1] = prefixes[key];
+                    node->m_names[i - start - 1] = names[key];
+                    node->m_blocks[i - start - 1] = blocks[key];
+                }
+            }
+            node->m_count = static_cast<int>(end - start) - 1;
+            upper.push_back(node);
+            upperFirsts.push_back(firsts[start]);
+        }
+        level.swap(upper);
+        firsts.swap(upperFirsts);
+    }
+    m_root = level[0];
+}
+
+NameIndex::Iterator NameIndex::lowerBound(const string& name, int block) const {
+    Iterator it;
+    it.m_leaf = nullptr;
+    it.m_pos = 0;
+    if (m_root == nullptr) {
+        return it;
+    }
+    uint64_t prefix = namePrefix(name);
+    const IndexNode* node = m_root;
+    while (!node->m_leaf) {
+        node = node->m_children[upperIndex(node, prefix, name, block)];
+    }
+    it.m_leaf = node;
+    it.m_pos = lowerIndex(node, prefix, name, block);
+    return it;
+}
+
+NameIndex::Iterator NameIndex::listPrefix(const string& prefix) const {
+    Iterator it = lowerBound(prefix, INT_MIN);
+    it.m_byPrefix = true;
+    it.m_bound = prefix;
+    it.settle();
+    return it;
+}
+
+NameIndex::Iterator NameIndex::listRange(const string& lo, const string& hi) const {
+    Iterator it = lowerBound(lo, INT_MIN);
+    it.m_byPrefix = false;
+    it.m_bound = hi;
+    it.settle();
+    return it;
+}
+
+void NameIndex::Iterator::next() {
+    m_pos++;
+    settle();
+}
+
+void NameIndex::Iterator::settle() {
+    while (m_leaf != nullptr && m_pos >= m_leaf->m_count) {
+        m_leaf = m_leaf->m_next;
+        m_pos = 0;
+    }
+    if (m_leaf == nullptr) {
+        return;
+    }
+    const string& name = m_leaf->m_names[m_pos];
+    bool inside = m_byPrefix ? name.compare(0, m_bound.size(), m_bound) == 0 : name < m_bound;
+    if (!inside) {
+        m_leaf = nullptr;
+    }
+}
+
+// TraceWriter and TraceReader
+static const char TRACEMAGIC[8] = {'F', 'S', 'T', 'R', 'A', 'C', 'E', '1'};
+
+TraceWriter::TraceWriter(const string& path) : m_out(path, std::ios::binary | std::ios::trunc), m_count(0) {
+    m_out.write(TRACEMAGIC, sizeof(TRACEMAGIC));
+}
+
+static void writeInt32(ofstream& out, int value) {
+    uint32_t bits = static_cast<uint32_t>(value);
+    char bytes[4] = {static_cast<char>(bits), static_cast<char>(bits >> 8),
+                     static_cast<char>(bits >> 16), static_cast<char>(bits >> 24)};
+    out.write(bytes, 4);
+}
+
+static bool readInt32(ifstream& in, int& value) {
+    unsigned char bytes[4];
+    if (!in.read(reinterpret_cast<char*>(bytes), 4)) {
+        return false;
+    }
+    value = static_cast<int>(bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<uint32_t>(bytes[3]) << 24));
+    return true;
+}
+
+void TraceWriter::write(trace_op_t op, const string& name, int block, int newBlock) {
+    m_out.put(static_cast<char>(op));
+    size_t length = name.size();
+    do {
+        char byte = length & 0x7f;
+        length >>= 7;
+        m_out.put(length ? (byte | 0x80) : byte);
+    } while (length);
+    m_out.write(name.data(), name.size());
+    writeInt32(m_out, block);
+    if (op == TRACEUPDATE) {
+        writeInt32(m_out, newBlock);
+    }
+    m_count++;
+}
+
+TraceReader::TraceReader(const string& path) : m_in(path, std::ios::binary) {
+    char magic[sizeof(TRACEMAGIC)];
+    m_good = m_in.read(magic, sizeof(magic)) && std::equal(magic, magic + sizeof(magic), TRACEMAGIC);
+}
+
+bool TraceReader::next(TraceRecord& record) {
+    int op = m_in.get();
+    if (!m_good || op < TRACEINSERT || op > TRACEUPDATE) {
+        return false; // end of the trace (or a truncated one)
+    }
+    size_t length = 0;
+    int shift = 0;
+    int byte;
+    do {
+        if ((byte = m_in.get()) == EOF) {
+            return false;
+        }
+        length |= static_cast<size_t>(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    record.m_op = static_cast<trace_op_t>(op);
+    record.m_name.resize(length);
+    if (!m_in.read(&record.m_name[0], length) || !readInt32(m_in, record.m_block)) {
+        return false;
+    }
+    record.m_newBlock = 0;
+    if (record.m_op == TRACEUPDATE && !readInt32(m_in, record.m_newBlock)) {
+        return false;
+    }
+    return true;
+}
+
+// FileSysSnapshot
+FileSysSnapshot::FileSysSnapshot(Segment** segments, int cap, int size, hash_fn hash)
+    : m_segments(segments), m_cap(cap), m_size(size), m_hash(hash) {}
+
+FileSysSnapshot::~FileSysSnapshot() {
+    releaseSegments(m_segments, m_cap);
+}
+
+const File* FileSysSnapshot::fileAt(int index) const {
+    File* file = m_segments[index / SEGMENTSLOTS]->m_slots[index % SEGMENTSLOTS];
+    return (file == reinterpret_cast<File*>(-1)) ? nullptr : file;
+}
+
+// Same probing as FileSys::getFile
+const File FileSysSnapshot::getFile(std::string name, int block) const {
+    int index = m_hash(name) % m_cap;
+    int step = 1;
+
+    File* slot;
+    while ((slot = m_segments[index / SEGMENTSLOTS]->m_slots[index % SEGMENTSLOTS]) != nullptr) {
+        if (slot != reinterpret_cast<File*>(-1) &&
+            slot->getName() == name &&
+            slot->getDiskBlock() == block) {
+            return *slot;
+        }
+
+        index = (index + static_cast<long>(step) * step) % m_cap; // Quadratic probing
+        step++;
+        if (step > m_cap) {
+            break; // Probing exhausted
+        }
+    }
+    throw std::runtime_error("File not found");
+}
+
+void FileSysSnapshot::dump() const {
+    std::cout << "Dump for the snapshot: " << std::endl;
+    dumpSegments(m_segments, m_cap);
+}
+
+// MissFilter
+MissFilter::MissFilter(int expected, float fpRate, int maxBytes) : m_numKeys(0) {
+    const double ln2 = std::log(2.0);
+    if (expected < 1) expected = 1;
+    m_capacity = expected;
+    double bitsPerKey = -std::log(fpRate) / (ln2 * ln2);
+    long blocks = static_cast<long>(std::ceil(expected * bitsPerKey / BLOCKBITS));
+    long maxBlocks = maxBytes / BLOCKBYTES;
+    if (blocks > maxBlocks) blocks = maxBlocks; // the budget wins over the rate
+    if (blocks < 1) blocks = 1;
+    m_numBlocks = static_cast<int>(blocks);
+
+    // Optimal number of bits per key for the bits actually available
+    double actualBitsPerKey = static_cast<double>(m_numBlocks) * BLOCKBITS / expected;
+    m_numHashes = static_cast<int>(std::lround(actualBitsPerKey * ln2));
+    if (m_numHashes < 1) m_numHashes = 1;
+    if (m_numHashes > 16) m_numHashes = 16;
+
+    m_bits = new uint64_t[static_cast<size_t>(m_numBlocks) * BLOCKWORDS]();
+}
+
+MissFilter::~MissFilter() {
+    delete[] m_bits;
+}
+
+// Hash of (name, block), independent of the table's hash function
+static uint64_t keyHash(const string& name, int block) {
+    // FNV-1a over the name, then the block, finished with the murmur3 mixer
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char ch : name) {
+        h = (h ^ ch) * 1099511628211ULL;
+    }
+    h ^= static_cast<uint64_t>(static_cast<uint32_t>(block)) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+void MissFilter::add(const string& name, int block) {
+    uint64_t h = keyHash(name, block);
+    uint64_t* words = m_bits + ((h >> 32) * static_cast<uint64_t>(m_numBlocks) >> 32) * BLOCKWORDS;
+    uint32_t a = static_cast<uint32_t>(h);
+    uint32_t b = static_cast<uint32_t>(h >> 41) | 1;
+    for (int i = 0; i < m_numHashes; ++i) {
+        uint32_t bit = (a + i * b) % BLOCKBITS;
+        words[bit / 64] |= (1ULL << (bit % 64));
+    }
+    m_numKeys++;
+}
+
+bool MissFilter::mayContain(const string& name, int block) const {
+    uint64_t h = keyHash(name, block);
+    const uint64_t* words = m_bits + ((h >> 32) * static_cast<uint64_t>(m_numBlocks) >> 32) * BLOCKWORDS;
+    uint32_t a = static_cast<uint32_t>(h);
+    uint32_t b = static_cast<uint32_t>(h >> 41) | 1;
+    for (int i = 0; i < m_numHashes; ++i) {
+        uint32_t bit = (a + i * b) % BLOCKBITS;
+        if ((words[bit / 64] & (1ULL << (bit % 64))) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+float MissFilter::expectedFpr() const {
+    double bits = static_cast<double>(m_numBlocks) * BLOCKBITS;
+    return static_cast<float>(std::pow(1.0 - std::exp(-m_numHashes * m_numKeys / bits), m_numHashes));
+}
+
+// Batch hashing
+// Plain char as in hashCode, so the scalar hash matches it whatever the
+// signedness of char. The SIMD kernels sign-extend, they are only built where
+// char is signed (see HASHSIMD).
+static inline unsigned int hashName33(const string& name) {
+    unsigned int val = 0;
+    for (char ch : name) {
+        val = val * 33 + ch;
+    }
+    return val;
+}
+
+unsigned int hashCode33(string name) {
+    return hashName33(name);
+}
+
+static void hashBatchScalar(const string* const* names, int count, unsigned int* hashes) {
+    for (int i = 0; i < count; ++i) {
+        hashes[i] = hashName33(*names[i]);
+    }
+}
+
+#ifdef HASHSIMD
+// The 16 bytes of name from offset. Bytes past the end of the name are masked
+// off by the kernels, so a name kept inside the string object (short string
+// optimization) is loaded with its whole buffer. Other tails are read with two
+// overlapping loads that stay inside the name, zero filled.
+__attribute__((target("sse2")))
+static inline __m128i chunkAt(const string& name, size_t offset) {
+    const char* p = name.data() + offset;
+    if (offset + 16 <= name.size()) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    }
+    const char* object = reinterpret_cast<const char*>(&name);
+    if (p >= object && p + 16 <= object + sizeof(string)) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    }
+    size_t n = (offset < name.size()) ? name.size() - offset : 0;
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+    if (n >= 8) {
+        uint64_t last;
+        memcpy(&lo, p, 8);
+        memcpy(&last, p + n - 8, 8);
+        hi = (n > 8) ? last >> (8 * (16 - n)) : 0;
+    } else if (n >= 4) {
+        uint32_t first;
+        uint32_t last;
+        memcpy(&first, p, 4);
+        memcpy(&last, p + n - 4, 4);
+        lo = first | (static_cast<uint64_t>(last) << (8 * (n - 4)));
+    } else {
+        for (size_t k = 0; k < n; ++k) {
+            lo |= static_cast<uint64_t>(static_cast<unsigned char>(p[k])) << (8 * k);
+        }
+    }
+    return _mm_set_epi64x(static_cast<long long>(hi), static_cast<long long>(lo));
+}
+
+// Every lane hashes one name. The lanes load 16 bytes of their names, a 4x4
+// transpose turns them into 4 vectors holding 4 bytes of every name each, and
+// each byte is sign-extended and folded in where it lies within the name.
+__attribute__((target("sse2")))
+static void hashBatchSse2(const string* const* names, int count, unsigned int* hashes) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        size_t maxLen = 0;
+        for (int k = 0; k < 4; ++k) {
+            maxLen = std::max(maxLen, names[i + k]->size());
+        }
+        __m128i len = _mm_set_epi32(names[i + 3]->size(), names[i + 2]->size(), names[i + 1]->size(), names[i]->size());
+        __m128i val = _mm_setzero_si128();
+        for (size_t offset = 0; offset < maxLen; offset += 16) {
+            __m128i r[4];
+            for (int k = 0; k < 4; ++k) {
+                r[k] = chunkAt(*names[i + k], offset);
+            }
+            __m128i t0 = _mm_unpacklo_epi32(r[0], r[1]);
+            __m128i t1 = _mm_unpacklo_epi32(r[2], r[3]);
+            __m128i t2 = _mm_unpackhi_epi32(r[0], r[1]);
+            __m128i t3 = _mm_unpackhi_epi32(r[2], r[3]);
+            __m128i columns[4] = {_mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1),
+                                  _mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t2, t3)};
+            for (int c = 0; c < 4; ++c) {
+                __m128i word = columns[c];
+                for (int b = 0; b < 4; ++b) {
+                    __m128i active = _mm_cmpgt_epi32(len, _mm_set1_epi32(static_cast<int>(offset) + 4 * c + b));
+                    __m128i ch = _mm_srai_epi32(_mm_slli_epi32(word, 24), 24);
+                    __m128i next = _mm_add_epi32(_mm_slli_epi32(val, 5), _mm_add_epi32(val, ch));
+                    val = _mm_or_si128(_mm_and_si128(active, next), _mm_andnot_si128(active, val));
+                    word = _mm_srli_epi32(word, 8);
+                }
+            }
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(hashes + i), val);
+    }
+    hashBatchScalar(names + i, count - i, hashes + i);
+}
+
+// As the SSE2 kernel, the two 128-bit halves hold names 0-3 and 4-7
+__attribute__((target("avx2")))
+static void hashBatchAvx2(const string* const* names, int count, unsigned int* hashes) {
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        size_t maxLen = 0;
+        int lens[8];
+        for (int k = 0; k < 8; ++k) {
+            lens[k] = static_cast<int>(names[i + k]->size());
+            maxLen = std::max(maxLen, names[i + k]->size());
+        }
+        __m256i len = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lens));
+        __m256i val = _mm256_setzero_si256();
+        for (size_t offset = 0; offset < maxLen; offset += 16) {
+            __m256i r[4];
+            for (int k = 0; k < 4; ++k) {
+                __m256i lo = _mm256_castsi128_si256(chunkAt(*names[i + k], offset));
+                r[k] = _mm256_inserti128_si256(lo, chunkAt(*names[i + k + 4], offset), 1);
+            }
+            __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+            __m256i t1 = _mm256_unpacklo_epi32(r[2], r[3]);
+            __m256i t2 = _mm256_unpackhi_epi32(r[0], r[1]);
+            __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+            __m256i columns[4] = {_mm256_unpacklo_epi64(t0, t1), _mm256_unpackhi_epi64(t0, t1),
+                                  _mm256_unpacklo_epi64(t2, t3), _mm256_unpackhi_epi64(t2, t3)};
+            for (int c = 0; c < 4; ++c) {
+                __m256i word = columns[c];
+                for (int b = 0; b < 4; ++b) {
+                    __m256i active = _mm256_cmpgt_epi32(len, _mm256_set1_epi32(static_cast<int>(offset) + 4 * c + b));
+                    __m256i ch = _mm256_srai_epi32(_mm256_slli_epi32(word, 24), 24);
+                    __m256i next = _mm256_add_epi32(_mm256_slli_epi32(val, 5), _mm256_add_epi32(val, ch));
+                    val = _mm256_blendv_epi8(val, next, active);
+                    word = _mm256_srli_epi32(word, 8);
+                }
+            }
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(hashes + i), val);
+    }
+    hashBatchSse2(names + i, count - i, hashes + i);
+}
+
+// As the SSE2 kernel, the four 128-bit parts hold names 0-3, 4-7, 8-11 and 12-15.
+// GCC 12 warns about the undefined vectors its own intrinsics start from.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+static void hashBatchAvx512(const string* const* names, int count, unsigned int* hashes) {
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        size_t maxLen = 0;
+        int lens[16];
+        for (int k = 0; k < 16; ++k) {
+            lens[k] = static_cast<int>(names[i + k]->size());
+            maxLen = std::max(maxLen, names[i + k]->size());
+        }
+        __m512i len = _mm512_loadu_si512(lens);
+        __m512i val = _mm512_setzero_si512();
+        for (size_t offset = 0; offset < maxLen; offset += 16) {
+            __m512i r[4];
+            for (int k = 0; k < 4; ++k) {
+                r[k] = _mm512_inserti32x4(_mm512_setzero_si512(), chunkAt(*names[i + k], offset), 0);
+                r[k] = _mm512_inserti32x4(r[k], chunkAt(*names[i + k + 4], offset), 1);
+                r[k] = _mm512_inserti32x4(r[k], chunkAt(*names[i + k + 8], offset), 2);
+                r[k] = _mm512_inserti32x4(r[k], chunkAt(*names[i + k + 12], offset), 3);
+            }
+            __m512i t0 = _mm512_unpacklo_epi32(r[0], r[1]);
+            __m512i t1 = _mm512_unpacklo_epi32(r[2], r[3]);
+            __m512i t2 = _mm512_unpackhi_epi32(r[0], r[1]);
+            __m512i t3 = _mm512_unpackhi_epi32(r[2], r[3]);
+            __m512i columns[4] = {_mm512_unpacklo_epi64(t0, t1), _mm512_unpackhi_epi64(t0, t1),
+                                  _mm512_unpacklo_epi64(t2, t3), _mm512_unpackhi_epi64(t2, t3)};
+            for (int c = 0; c < 4; ++c) {
+                __m512i word = columns[c];
+                for (int b = 0; b < 4; ++b) {
+                    __mmask16 active = _mm512_cmpgt_epi32_mask(len, _mm512_set1_epi32(static_cast<int>(offset) + 4 * c + b));
+                    __m512i ch = _mm512_srai_epi32(_mm512_slli_epi32(word, 24), 24);
+                    val = _mm512_mask_add_epi32(val, active, _mm512_slli_epi32(val, 5), _mm512_add_epi32(val, ch));
+                    word = _mm512_srli_epi32(word, 8);
+                }
+            }
+        }
+        _mm512_storeu_si512(hashes + i, val);
+    }
+    hashBatchAvx2(names + i, count - i, hashes + i);
+}
+#pragma GCC diagnostic pop
+#endif
+
+simd_t simdSupport() {
+#ifdef HASHSIMD
+    static const simd_t support = __builtin_cpu_supports("avx512f") ? SIMDAVX512
+                                : __builtin_cpu_supports("avx2") ? SIMDAVX2
+                                : __builtin_cpu_supports("sse2") ? SIMDSSE2 : SIMDSCALAR;
+    return support;
+#else
+    return SIMDSCALAR;
+#endif
+}
+
+void hashCode33BatchWith(simd_t isa, const string* const* names, int count, unsigned int* hashes) {
+    switch (std::min(isa, simdSupport())) {
+#ifdef HASHSIMD
+    case SIMDAVX512:
+        hashBatchAvx512(names, count, hashes);
+        break;
+    case SIMDAVX2:
+        hashBatchAvx2(names, count, hashes);
+        break;
+    case SIMDSSE2:
+        hashBatchSse2(names, count, hashes);
+        break;
+#endif
+    default:
+        hashBatchScalar(names, count, hashes);
+        break;
+    }
+}
+
+// In bulk loads (mybench simdhash) SSE2 never beat the scalar loop, and AVX2
+// and AVX-512 lost to it on names shorter than SIMDMINLENGTH: the lanes run to
+// the longest name of their group, 16 bytes at a time
+void hashCode33Batch(const string* const* names, int count, unsigned int* hashes) {
+    simd_t isa = simdSupport();
+    if (isa >= SIMDAVX2) {
+        long bytes = 0;
+        for (int i = 0; i < count; ++i) {
+            bytes += names[i]->size();
+        }
+        if (bytes < static_cast<long>(SIMDMINLENGTH) * count) {
+            isa = SIMDSCALAR; // Names too short to pay off
+        }
+    } else {
+        isa = SIMDSCALAR;
+    }
+    hashCode33BatchWith(isa, names, count, hashes);
+}
+
+// PerfectHash
+// murmur3 finalizer of the pilot, XORed into the key hash
+static uint64_t pilotMix(uint32_t pilot) {
+    uint64_t h = (pilot + 1) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+PerfectHash::PerfectHash()
+    : m_files(nullptr), m_pilots(nullptr), m_size(0), m_numBuckets(0) {}
+
+PerfectHash::~PerfectHash() {
+    delete[] m_files;
+    delete[] m_pilots;
+}
+
+int PerfectHash::slotOf(uint64_t h) const {
+    uint32_t pilot = m_pilots[(h >> 32) * m_numBuckets >> 32];
+    if (pilot & DIRECT) {
+        return static_cast<int>(pilot & ~DIRECT);
+    }
+    return static_cast<int>(static_cast<uint32_t>(h ^ pilotMix(pilot)) * static_cast<uint64_t>(m_size) >> 32);
+}
+
+bool PerfectHash::build(const vector<const File*>& files) {
+    int n = static_cast<int>(files.size());
+    int numBuckets = std::max(1, (n + BUCKETKEYS - 1) / BUCKETKEYS);
+    vector<uint64_t> hashes(n);
+    vector<int> bucketStart(numBuckets + 1, 0);
+    for (int i = 0; i < n; ++i) {
+        hashes[i] = keyHash(files[i]->getName(), files[i]->getDiskBlock());
+        bucketStart[((hashes[i] >> 32) * numBuckets >> 32) + 1]++;
+    }
+    for (int b = 0; b < numBuckets; ++b) {
+        bucketStart[b + 1] += bucketStart[b];
+    }
+    // Keys grouped by bucket
+    vector<int> keys(n);
+    vector<int> fill(bucketStart.begin(), bucketStart.end() - 1);
+    for (int i = 0; i < n; ++i) {
+        keys[fill[(hashes[i] >> 32) * numBuckets >> 32]++] = i;
+    }
+    // Largest buckets first, while most slots are still free
+    vector<int> order(numBuckets);
+    for (int b = 0; b < numBuckets; ++b) {
+        order[b] = b;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return bucketStart[a + 1] - bucketStart[a] > bucketStart[b + 1] - bucketStart[b];
+    });
+
+    uint32_t* pilots = new uint32_t[numBuckets]();
+    vector<bool> taken(n, false);
+    vector<int> slots;
+    int nextFree = 0;
+    for (int b : order) {
+        int first = bucketStart[b];
+        int count = bucketStart[b + 1] - first;
+        if (count == 0) {
+            break;
+        }
+        if (count == 1) {
+            // A single key takes any free slot, the pilot stores the slot itself
+            while (taken[nextFree]) {
+                nextFree++;
+            }
+            taken[nextFree] = true;
+            pilots[b] = DIRECT | static_cast<uint32_t>(nextFree);
+            continue;
+        }
+        uint32_t pilot = 0;
+        for (; pilot < MAXPILOT; ++pilot) {
+            uint64_t mix = pilotMix(pilot);
+            slots.clear();
+            for (int k = first; k < first + count; ++k) {
+                int slot = static_cast<int>(static_cast<uint32_t>(hashes[keys[k]] ^ mix) * static_cast<uint64_t>(n) >> 32);
+                if (taken[slot] || std::find(slots.begin(), slots.end(), slot) != slots.end()) {
+                    break;
+                }
+                slots.push_back(slot);
+            }
+            if (static_cast<int>(slots.size()) == count) {
+                break;
+            }
+        }
+        if (pilot == MAXPILOT) {
+            delete[] pilots; // Keys whose hashes collide cannot be separated
+            return false;
+        }
+        for (int slot : slots) {
+            taken[slot] = true;
+        }
+        pilots[b] = pilot;
+    }
+
+    delete[] m_files;
+    delete[] m_pilots;
+    m_pilots = pilots;
+    m_numBuckets = numBuckets;
+    m_size = n;
+    m_files = new File[n];
+    for (int i = 0; i < n; ++i) {
+        m_files[slotOf(hashes[i])] = *files[i];
+    }
+    return true;
+}
+
+const File* PerfectHash::find(const string& name, int block) const {
+    if (m_size == 0) {
+        return nullptr;
+    }
+    const File* file = &m_files[slotOf(keyHash(name, block))];
+    if (file->m_diskBlock == block && file->m_name == name) {
+        return file;
+    }
+    return nullptr;
+}
+
+// DigestTree
+static const char DIGESTMAGIC[8] = {'F', 'S', 'D', 'I', 'G', 'E', 'S', 'T'};
+
+static void writeInt64(ofstream& out, uint64_t value) {
+    writeInt32(out, static_cast<int>(static_cast<uint32_t>(value)));
+    writeInt32(out, static_cast<int>(static_cast<uint32_t>(value >> 32)));
+}
+
+static bool readInt64(ifstream& in, uint64_t& value) {
+    int low;
+    int high;
+    if (!readInt32(in, low) || !readInt32(in, high)) {
+        return false;
+    }
+    value = static_cast<uint32_t>(low) | (static_cast<uint64_t>(static_cast<uint32_t>(high)) << 32);
+    return true;
+}
+
+static bool sameDigest(const Digest& a, const Digest& b) {
+    return a.m_xor == b.m_xor && a.m_sum == b.m_sum && a.m_count == b.m_count;
+}
+
+// Range of a key hash, from its top bits
+static int digestRange(uint64_t h) {
+    return static_cast<int>((h >> 32) * DIGESTRANGES >> 32);
+}
+
+DigestTree::DigestTree() : m_nodes(2 * DIGESTRANGES, Digest{0, 0, 0}), m_keys(DIGESTRANGES) {}
+
+void DigestTree::update(uint64_t h, int sign) {
+    for (int node = DIGESTRANGES + digestRange(h); node >= 1; node /= 2) {
+        m_nodes[node].m_xor ^= h;
+        m_nodes[node].m_sum += (sign > 0) ? h : -h;
+        m_nodes[node].m_count += sign;
+    }
+}
+
+void DigestTree::add(const string& name, int block) {
+    uint64_t h = keyHash(name, block);
+    update(h, 1);
+    m_keys[digestRange(h)].push_back(RangeKey{h, name, block});
+}
+
+void DigestTree::remove(const string& name, int block) {
+    uint64_t h = keyHash(name, block);
+    vector<RangeKey>& keys = m_keys[digestRange(h)];
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (keys[i].m_hash == h && keys[i].m_block == block && keys[i].m_name == name) {
+            keys[i] = std::move(keys.back());
+            keys.pop_back();
+            update(h, -1);
+            return;
+        }
+    }
+}
+
+vector<int> DigestTree::diffRanges(const DigestTree& other) const {
+    vector<int> ranges;
+    vector<int> pending(1, 1); // Start at the root
+    while (!pending.empty()) {
+        int node = pending.back();
+        pending.pop_back();
+        if (sameDigest(m_nodes[node], other.m_nodes[node])) {
+            continue; // The whole subtree matches
+        }
+        if (node >= DIGESTRANGES) {
+            ranges.push_back(node - DIGESTRANGES);
+        } else {
+            pending.push_back(2 * node + 1);
+            pending.push_back(2 * node);
+        }
+    }
+    return ranges;
+}
+
+vector<File> DigestTree::entries(const vector<int>& ranges) const {
+    vector<File> files;
+    for (int range : ranges) {
+        for (const RangeKey& key : m_keys[range]) {
+            files.push_back(File(key.m_name, key.m_block, true));
+        }
+    }
+    return files;
+}
+
+bool DigestTree::save(const string& path) const {
+    ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(DIGESTMAGIC, sizeof(DIGESTMAGIC));
+    writeInt32(out, DIGESTRANGES);
+    for (int node = 1; node < 2 * DIGESTRANGES; ++node) {
+        writeInt64(out, m_nodes[node].m_xor);
+        writeInt64(out, m_nodes[node].m_sum);
+        writeInt64(out, static_cast<uint64_t>(m_nodes[node].m_count));
+    }
+    return out.good();
+}
+
+bool DigestTree::load(const string& path) {
+    ifstream in(path, std::ios::binary);
+    char magic[sizeof(DIGESTMAGIC)];
+    int ranges;
+    if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), DIGESTMAGIC) ||
+        !readInt32(in, ranges) || ranges != DIGESTRANGES) {
+        return false;
+    }
+    vector<Digest> nodes(2 * DIGESTRANGES, Digest{0, 0, 0});
+    for (int node = 1; node < 2 * DIGESTRANGES; ++node) {
+        uint64_t count;
+        if (!readInt64(in, nodes[node].m_xor) || !readInt64(in, nodes[node].m_sum) || !readInt64(in, count)) {
+            return false;
+        }
+        nodes[node].m_count = static_cast<int64_t>(count);
+    }
+    m_nodes.swap(nodes);
+    m_keys.assign(DIGESTRANGES, vector<RangeKey>());
+    return true;
+}
+
+bool DigestTree::saveEntries(const string& path, const vector<File>& files) {
+    TraceWriter trace(path);
+    for (const File& file : files) {
+        trace.write(TRACEINSERT, file.getName(), file.getDiskBlock());
+    }
+    return trace.good();
+}
+
+bool DigestTree::loadEntries(const string& path, vector<File>& files) {
+    TraceReader trace(path);
+    if (!trace.good()) {
+        return false;
+    }
+    files.clear();
+    TraceRecord record;
+    while (trace.next(record)) {
+        if (record.m_op == TRACEINSERT) {
+            files.push_back(File(record.m_name, record.m_block, true));
+        }
+    }
+    return true;
+}
+
+void DigestTree::diffEntries(const vector<File>& mine, const vector<File>& theirs,
+                             vector<File>& onlyMine, vector<File>& onlyTheirs) {
+    auto before = [](const File& a, const File& b) {
+        return a.getName() != b.getName() ? a.getName() < b.getName() : a.getDiskBlock() < b.getDiskBlock();
+    };
+    vector<File> a(mine);
+    vector<File> b(theirs);
+    std::sort(a.begin(), a.end(), before);
+    std::sort(b.begin(), b.end(), before);
+    onlyMine.clear();
+    onlyTheirs.clear();
+    std::set_difference(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(onlyMine), before);
+    std::set_difference(b.begin(), b.end(), a.begin(), a.end(), std::back_inserter(onlyTheirs), before);
+}
+
+// CompactFileSys
+static int nextPrimeAtLeast(int number) {
+    while (true) {
+        bool prime = number > 1;
+        for (int i = 2; prime && static_cast<long>(i) * i <= number; ++i) {
+            if (number % i == 0) {
+                prime = false;
+            }
+        }
+        if (prime) {
+            return number;
+        }
+        number++;
+    }
+}
+
+CompactFileSys::CompactFileSys(int size, hash_fn hash, prob_t probing)
+    : m_hash(hash), m_probing(probing), m_cap(nextPrimeAtLeast(size < MINPRIME ? MINPRIME : size)),
+      m_size(0), m_numDeleted(0), m_arenaGarbage(0) {
+    m_words = new uint64_t[m_cap]();
+    m_offsets = new uint32_t[m_cap]();
+}
+
+CompactFileSys::~CompactFileSys() {
+    delete[] m_words;
+    delete[] m_offsets;
+}
+
+uint64_t CompactFileSys::pack(int block, bool used, unsigned int tag) {
+    return static_cast<uint64_t>(block) | (LIVE << STATESHIFT) | (used ? USEDBIT : 0) |
+           (static_cast<uint64_t>(tag) << TAGSHIFT);
+}
+
+// Append name with a varint length prefix and return its offset
+uint32_t CompactFileSys::appendName(const string& name) {
+    size_t offset = m_arena.size();
+    if (offset + name.size() + 5 > UINT32_MAX) {
+        throw std::length_error("Name arena is full");
+    }
+    if (m_arena.capacity() - offset < name.size() + 5) {
+        // Grow by a quarter instead of the vector's doubling, which can leave
+        // half the arena unused
+        m_arena.reserve(offset + name.size() + 5 + offset / 4);
+    }
+    size_t length = name.size();
+    do {
+        char byte = length & 0x7f;
+        length >>= 7;
+        m_arena.push_back(length ? (byte | 0x80) : byte);
+    } while (length);
+    m_arena.insert(m_arena.end(), name.begin(), name.end());
+    return static_cast<uint32_t>(offset);
+}
+
+// Decode the varint length at offset, leaves offset at the first name byte
+static size_t nameLength(const vector<char>& arena, uint32_t& offset) {
+    size_t length = 0;
+    int shift = 0;
+    unsigned char byte;
+    do {
+        byte = arena[offset++];
+        length |= static_cast<size_t>(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return length;
+}
+
+bool CompactFileSys::nameEquals(uint32_t offset, const string& name) const {
+    size_t length = nameLength(m_arena, offset);
+    return length == name.size() && name.compare(0, length, &m_arena[offset], length) == 0;
+}
+
+string CompactFileSys::nameAt(uint32_t offset) const {
+    size_t length = nameLength(m_arena, offset);
+    return string(&m_arena[offset], length);
+}
+
+int CompactFileSys::find(const string& name, int block) const {
+    unsigned int tag = m_hash(name);
+    int index = tag % m_cap;
+    int step = 1;
+
+    uint64_t word;
+    while (state(word = m_words[index]) != EMPTY) {
+        // the tag and block reject almost every other entry without touching the arena
+        if (state(word) == LIVE && (word >> TAGSHIFT) == tag && CompactFileSys::block(word) == block &&
+            nameEquals(m_offsets[index], name)) {
+            return index;
+        }
+
+        index = (index + static_cast<long>(step) * step) % m_cap; // Quadratic probing
+        step++;
+        if (step > m_cap) {
+            break; // Probing exhausted
+        }
+    }
+    return -1;
+}
+
+bool CompactFileSys::insert(File file) {
+    int block = file.getDiskBlock();
+    if (block < 0 || block > static_cast<int>(BLOCKMASK)) {
+        return false; // Does not fit the packed word
+    }
+    // Deleted slots count towards the load since they lengthen probe chains,
+    // grow only if live entries alone are above half the capacity. Growing by
+    // half keeps the load between 0.5 and 0.75, doubling would let it fall to 0.375
+    if (m_size + m_numDeleted >= m_cap * 0.75) {
+        rehash(m_size >= m_cap / 2 ? nextPrimeAtLeast(m_cap + m_cap / 2) : m_cap);
+    }
+
+    unsigned int tag = m_hash(file.getName());
+    int index = tag % m_cap;
+    int step = 1;
+    int target = -1; // first deleted slot on the probe sequence
+
+    uint64_t word;
+    while (state(word = m_words[index]) != EMPTY) {
+        if (state(word) == LIVE) {
+            if ((word >> TAGSHIFT) == tag && CompactFileSys::block(word) == block &&
+                nameEquals(m_offsets[index], file.getName())) {
+                return false; // Duplicate entry
+            }
+        } else if (target == -1) {
+            target = index;
+        }
+
+        index = (index + static_cast<long>(step) * step) % m_cap; // Quadratic probing
+        step++;
+        if (step > m_cap) {
+            break; // Probing exhausted
+        }
+    }
+    if (state(word) == EMPTY) {
+        target = (target == -1) ? index : target;
+    }
+    if (target == -1) {
+        return false; // Probing exhausted
+    }
+
+    // Append first, appendName may throw and the slot must stay as it was
+    uint32_t offset = appendName(file.getName());
+    if (state(m_words[target]) == DELETED) {
+        m_numDeleted--; // Reusing a deleted slot
+    }
+    m_words[target] = pack(block, file.getUsed(), tag);
+    m_offsets[target] = offset;
+    m_size++;
+    return true;
+}
+
+bool CompactFileSys::remove(File file) {
+    int index = find(file.getName(), file.getDiskBlock());
+    if (index == -1) {
+        return false; // File not found
+    }
+    uint32_t offset = m_offsets[index];
+    size_t length = nameLength(m_arena, offset);
+    m_arenaGarbage += (offset - m_offsets[index]) + length;
+    m_words[index] = DELETED << STATESHIFT;
+    m_size--;
+    m_numDeleted++;
+    return true;
+}
+
+const File CompactFileSys::getFile(string name, int block) const {
+    int index = find(name, block);
+    if (index == -1) {
+        throw std::runtime_error("File not found");
+    }
+    uint64_t word = m_words[index];
+    return File(nameAt(m_offsets[index]), CompactFileSys::block(word), (word & USEDBIT) != 0);
+}
+
+bool CompactFileSys::updateDiskBlock(File file, int block) {
+    if (block < 0 || block > static_cast<int>(BLOCKMASK)) {
+        return false; // Does not fit the packed word
+    }
+    int index = find(file.getName(), file.getDiskBlock());
+    if (index == -1) {
+        return false; // File not found
+    }
+    if (block != file.getDiskBlock() && find(file.getName(), block) != -1) {
+        return false; // Would duplicate an entry
+    }
+    m_words[index] = (m_words[index] & ~BLOCKMASK) | static_cast<uint64_t>(block);
+    return true;
+}
+
+float CompactFileSys::lambda() const {
+    return static_cast<float>(m_size) / m_cap;
+}
+
+float CompactFileSys::deletedRatio() const {
+    return static_cast<float>(m_numDeleted) / m_cap;
+}
+
+long CompactFileSys::memoryBytes() const {
+    return static_cast<long>(m_cap) * (sizeof(uint64_t) + sizeof(uint32_t)) + m_arena.capacity();
+}
+
+// Move the live entries into newCap slots and a compacted arena
+void CompactFileSys::rehash(int newCap) {
+    uint64_t* newWords = new uint64_t[newCap]();
+    uint32_t* newOffsets = new uint32_t[newCap]();
+    vector<char> oldArena;
+    oldArena.swap(m_arena);
+    m_arena.reserve(oldArena.size() - m_arenaGarbage);
+
+    for (int i = 0; i < m_cap; ++i) {
+        uint64_t word = m_words[i];
+        if (state(word) != LIVE) {
+            continue;
+        }
+        int index = (word >> TAGSHIFT) % newCap;
+        int step = 1;
+        while (state(newWords[index]) != EMPTY) {
+            index = (index + static_cast<long>(step) * step) % newCap;
+            step++;
+        }
+        uint32_t offset = m_offsets[i];
+        size_t length = nameLength(oldArena, offset);
+        newWords[index] = word;
+        newOffsets[index] = appendName(string(&oldArena[offset], length));
+    }
+
+    delete[] m_words;
+    delete[] m_offsets;
+    m_words = newWords;
+    m_offsets = newOffsets;
+    m_cap = newCap;
+    m_numDeleted = 0;
+    m_arenaGarbage = 0;
+}
+
+void CompactFileSys::dump() const {
+    std::cout << "Dump for the compact table: " << std::endl;
+    for (int i = 0; i < m_cap; i++) {
+        uint64_t word = m_words[i];
+        if (state(word) == LIVE) {
+            std::cout << "[" << i << "] : " << nameAt(m_offsets[i]) << ", Block: " << block(word) << std::endl;
+        } else if (state(word) == DELETED) {
+            std::cout << "[" << i << "] : Deleted" << std::endl;
+        } else {
+            std::cout << "[" << i << "] : Empty" << std::endl;
+        }
+    }
 }
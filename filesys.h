@@ -3,6 +3,10 @@
 #define FILESYS_H
 #include <iostream>
 #include <string>
+#include <cstdint>
+#include <atomic>
+#include <vector>
+#include <fstream>
 #include "math.h"
 using namespace std;
 const int DISKMIN = 100000;
@@ -10,16 +14,33 @@ const int DISKMAX = 999999;
 const int MINPRIME = 101;   // Min size for hash table
 const int MAXPRIME = 99991; // Max size for hash table
 typedef unsigned int (*hash_fn)(string); // declaration of hash function
+typedef void (*batch_hash_fn)(const string* const* names, int count, unsigned int* hashes); // hashes many names at once
+class File;
+typedef void (*evict_fn)(const File&, void* context); // called with every file evicted in cache mode
 enum prob_t {QUADRATIC, DOUBLEHASH, LINEAR}; // types of collision handling policy
 #define DEFPOLCY QUADRATIC
+enum trace_op_t {TRACEINSERT, TRACEREMOVE, TRACEGET, TRACEUPDATE}; // operations recorded in a trace
+enum page_t {PAGEDEFAULT, PAGETHP, PAGEHUGETLB};   // pages backing the slot array of a table
+enum numa_t {NUMANONE, NUMAINTERLEAVE, NUMAFIRSTTOUCH}; // placement of the slot array across NUMA nodes
+enum simd_t {SIMDSCALAR, SIMDSSE2, SIMDAVX2, SIMDAVX512};  // instruction sets of the batch hash kernels
+const float DEFFILTERFPR = 0.01;     // default false-positive rate of the miss filter
+const int DEFFILTERBYTES = 1 << 20;  // default memory budget of the miss filter (bytes)
+const int SEGMENTSLOTS = 512;       // slots per table segment (one 4 KiB page of pointers)
+const int INDEXORDER = 32;          // keys per node of the ordered name index
+const size_t HUGEPAGE = 2 << 20;    // huge page size, slot arrays smaller than this stay on the heap
+const int HASHBATCH = 64;           // names hashed together by insertBatch and getFiles
+const int SIMDMINLENGTH = 32;       // mean name length (bytes) from which hashCode33Batch uses SIMD
+const int DIGESTRANGES = 4096;      // key hash ranges of the replica digests (a power of 2)
 class Grader;
 class Tester;
 class FileSys;
+class PerfectHash;
 class File{
     public:
     friend class Grader;
     friend class Tester;
     friend class FileSys;
+    friend class PerfectHash;
     File(string name="", int diskBlock=0, bool used=false){
         m_name = name; m_diskBlock = diskBlock; m_used = used;
     }
@@ -71,6 +92,265 @@ class File{
     bool m_used;
 };
 
+// The slot array of a table is split into segments of SEGMENTSLOTS slots.
+// Snapshots share segments with the live table, a write to a shared segment
+// copies it (and the files it holds) first, so shared segments never change.
+struct SlotRegion;
+struct Segment{
+    std::atomic<int> m_refs;        // the live table plus the snapshots sharing it
+    SlotRegion* m_region;           // mapping holding the segment, nullptr if allocated with new
+    File* m_slots[SEGMENTSLOTS];    // nullptr if empty, File*(-1) if deleted
+};
+
+// Order-independent digest of a set of (name, block) keys
+struct Digest{
+    uint64_t   m_xor;           // XOR of the key hashes
+    uint64_t   m_sum;           // sum of the key hashes (mod 2^64)
+    int64_t    m_count;         // number of keys
+};
+
+// A node of the ordered name index. Keys are (name, block) pairs ordered by name
+// then block. The first 8 bytes of every name are kept big-endian in m_prefixes,
+// so most comparisons in a node scan one contiguous array without touching strings.
+struct IndexNode{
+    bool       m_leaf;
+    int        m_count;                         // number of keys
+    uint64_t   m_prefixes[INDEXORDER];
+    string     m_names[INDEXORDER];
+    int        m_blocks[INDEXORDER];
+    IndexNode* m_children[INDEXORDER + 1];      // internal nodes, m_count + 1 children
+    IndexNode* m_next;                          // leaves, the next leaf in key order
+};
+
+// A B+tree over (name, block) keys, the optional ordered secondary index of FileSys.
+// Removal does not rebalance, the tree is rebuilt once it is mostly empty.
+class NameIndex{
+    public:
+    friend class Grader;
+    friend class Tester;
+    // A streaming cursor over the keys of a prefix or a range, in key order.
+    // It is invalidated by any change to the index.
+    class Iterator{
+        public:
+        friend class NameIndex;
+        bool valid() const {return m_leaf != nullptr;}
+        const string& name() const {return m_leaf->m_names[m_pos];}
+        int block() const {return m_leaf->m_blocks[m_pos];}
+        void next();
+        private:
+        const IndexNode* m_leaf;    // nullptr once past the end
+        int        m_pos;
+        bool       m_byPrefix;      // stop at the first name without m_bound as prefix,
+        string     m_bound;         // otherwise at the first name not below m_bound
+        void settle();              // skip empty leaves and stop past the end
+    };
+    NameIndex();
+    ~NameIndex();
+    // both return false if the key is already present (insert) or absent (remove)
+    bool insert(const string& name, int block);
+    bool remove(const string& name, int block);
+    int size() const {return m_size;}
+    // names starting with prefix
+    Iterator listPrefix(const string& prefix) const;
+    // names in [lo, hi)
+    Iterator listRange(const string& lo, const string& hi) const;
+    private:
+    IndexNode* m_root;
+    IndexNode* m_firstLeaf;
+    int        m_size;          // number of keys
+    int        m_numLeaves;     // number of leaves, including empty ones
+
+    // first leaf position holding a key not below (name, block)
+    Iterator lowerBound(const string& name, int block) const;
+    // rebuild a packed tree from the leaf chain
+    void rebuild();
+    void destroy(IndexNode* node);
+};
+
+// One operation of a FileSys trace
+struct TraceRecord{
+    trace_op_t m_op;
+    string     m_name;
+    int        m_block;
+    int        m_newBlock;      // TRACEUPDATE only
+};
+
+// Writes a compact binary trace: the magic "FSTRACE1", then per record the op
+// byte, the name length as a varint, the name, the block as 4 little-endian
+// bytes and, for updates, the new block the same way.
+class TraceWriter{
+    public:
+    TraceWriter(const string& path);
+    bool good() const {return m_out.good();}
+    void write(trace_op_t op, const string& name, int block, int newBlock = 0);
+    long count() const {return m_count;}
+    private:
+    ofstream   m_out;
+    long       m_count;         // records written
+};
+
+class TraceReader{
+    public:
+    TraceReader(const string& path);
+    // false if the file could not be opened or is not a trace
+    bool good() const {return m_good;}
+    // reads the next record, false at the end of the trace
+    bool next(TraceRecord& record);
+    private:
+    ifstream   m_in;
+    bool       m_good;
+};
+
+// Digests of the keys of a table over DIGESTRANGES fixed ranges of a 64-bit key
+// hash, kept in a binary tree whose nodes digest the ranges below them. Replicas
+// compare trees from the root and descend only where digests differ, so the work
+// grows with the divergence. The keys of every range are kept as well, so the
+// entries of a range are listed without scanning the table.
+class DigestTree{
+    public:
+    friend class Grader;
+    friend class Tester;
+    DigestTree();
+    void add(const string& name, int block);
+    void remove(const string& name, int block);
+    // digest of node index, 1 is the root and DIGESTRANGES + r the leaf of range r
+    const Digest& node(int index) const {return m_nodes[index];}
+    // ranges whose digests differ from those of other, in increasing order
+    vector<int> diffRanges(const DigestTree& other) const;
+    // the keys of the given ranges as files, none for a tree loaded from a file
+    vector<File> entries(const vector<int>& ranges) const;
+    // the digests without the keys, as exchanged between replicas
+    bool save(const string& path) const;
+    bool load(const string& path);
+    // entries are exchanged as traces of inserts, so a replica may also replay them
+    static bool saveEntries(const string& path, const vector<File>& files);
+    static bool loadEntries(const string& path, vector<File>& files);
+    // splits the entries of the same ranges on two replicas into those only in mine and only in theirs
+    static void diffEntries(const vector<File>& mine, const vector<File>& theirs,
+                            vector<File>& onlyMine, vector<File>& onlyTheirs);
+    private:
+    struct RangeKey{
+        uint64_t   m_hash;
+        string     m_name;
+        int        m_block;
+    };
+    vector<Digest>   m_nodes;               // 2 * DIGESTRANGES nodes in heap order, 0 unused
+    vector<vector<RangeKey>> m_keys;        // keys of every range
+
+    void update(uint64_t h, int sign);      // adds (1) or removes (-1) h along a leaf-to-root path
+};
+
+// A read-only point-in-time view of a FileSys, created by FileSys::snapshot()
+// and deleted by the caller. It may be read on another thread while the table
+// keeps taking writes.
+class FileSysSnapshot{
+    public:
+    friend class Grader;
+    friend class Tester;
+    friend class FileSys;
+    ~FileSysSnapshot();
+    // find a file as it was when the snapshot was taken
+    const File getFile(string name, int block) const;
+    int size() const {return m_size;}
+    int capacity() const {return m_cap;}
+    // file stored at index, nullptr if the slot is empty or deleted
+    const File* fileAt(int index) const;
+    void dump() const;
+    private:
+    FileSysSnapshot(Segment** segments, int cap, int size, hash_fn hash);
+    FileSysSnapshot(const FileSysSnapshot&) = delete;
+    FileSysSnapshot& operator=(const FileSysSnapshot&) = delete;
+    Segment**  m_segments;      // shared segments, one reference held on each
+    int        m_cap;           // capacity of the table when the snapshot was taken
+    int        m_size;          // number of files in the snapshot
+    hash_fn    m_hash;          // hash function of the table
+};
+
+// statistics reported by FileSys::filterStats()
+struct FilterStats{
+    bool  enabled = false;      // whether the miss filter is in use
+    int   bytes = 0;            // memory used by the filter bits
+    int   budget = 0;           // memory budget requested for the filter
+    int   numHashes = 0;        // number of bits set per key
+    float targetFpr = 0;        // requested false-positive rate
+    float expectedFpr = 0;      // estimated false-positive rate at the current fill
+    long  lookups = 0;          // getFile calls that consulted the filter
+    long  rejected = 0;         // lookups answered by the filter without probing
+    long  falsePositives = 0;   // lookups that passed the filter but missed the table
+    int   staleKeys = 0;        // removed keys whose bits are still set
+};
+
+// A blocked Bloom filter, every key sets all of its bits inside a single
+// 64-byte block so a lookup touches only one cache line.
+// Bits cannot be cleared, removed keys stay in the filter (as false positives)
+// until the owner rebuilds it.
+class MissFilter{
+    public:
+    friend class Grader;
+    friend class Tester;
+    // expected is the number of keys the filter is sized for, the size is
+    // capped by maxBytes, which may raise the actual false-positive rate
+    MissFilter(int expected, float fpRate, int maxBytes);
+    ~MissFilter();
+    void add(const string& name, int block);
+    bool mayContain(const string& name, int block) const;
+    int bytes() const {return m_numBlocks * BLOCKBYTES;}
+    int numHashes() const {return m_numHashes;}
+    int numKeys() const {return m_numKeys;}
+    int capacity() const {return m_capacity;}
+    // estimated false-positive rate for the number of keys added so far
+    float expectedFpr() const;
+    private:
+    static const int BLOCKBYTES = 64;            // one cache line
+    static const int BLOCKWORDS = BLOCKBYTES / 8;
+    static const int BLOCKBITS = BLOCKBYTES * 8;
+    uint64_t*  m_bits;          // m_numBlocks blocks of BLOCKWORDS words
+    int        m_numBlocks;     // number of blocks
+    int        m_numHashes;     // bits set per key
+    int        m_numKeys;       // keys added since construction
+    int        m_capacity;      // number of keys the filter was sized for
+};
+
+// A minimal perfect hash over a fixed set of files, built by FileSys::freeze().
+// Keys are split into buckets of about BUCKETKEYS and every bucket keeps a pilot
+// that sends its keys to free slots (PTHash style), so n files fill exactly n
+// slots of one array and a lookup reads one pilot and one slot.
+class PerfectHash{
+    public:
+    friend class Grader;
+    friend class Tester;
+    PerfectHash();
+    ~PerfectHash();
+    // copies the files into slot order, false if some bucket found no pilot
+    bool build(const vector<const File*>& files);
+    // the file stored for (name, block), nullptr if there is none
+    const File* find(const string& name, int block) const;
+    int size() const {return m_size;}
+    const File* fileAt(int index) const {return &m_files[index];}
+    private:
+    static const int BUCKETKEYS = 2;             // average keys per bucket
+    static const uint32_t DIRECT = 1u << 31;     // pilot flag, the rest is the slot of a single key
+    static const uint32_t MAXPILOT = 1u << 24;   // pilots tried per bucket before giving up
+    File*      m_files;         // m_size files in slot order
+    uint32_t*  m_pilots;        // one per bucket
+    int        m_size;          // number of files (and slots)
+    int        m_numBuckets;
+
+    int slotOf(uint64_t h) const;
+};
+
+// The textbook hash val * 33 + c over the chars of name, with the signedness
+// of plain char like hashCode (signed on x86, unsigned on e.g. aarch64)
+unsigned int hashCode33(string name);
+// hashCode33 of count names, 8 or 16 at a time in SIMD lanes when the CPU has
+// AVX2 or AVX-512 and the names average SIMDMINLENGTH bytes, else one at a
+// time. The hashes are bit-identical to hashCode33.
+void hashCode33Batch(const string* const* names, int count, unsigned int* hashes);
+// The same with a given kernel, clamped to what the CPU supports
+void hashCode33BatchWith(simd_t isa, const string* const* names, int count, unsigned int* hashes);
+// Widest kernel the CPU supports
+simd_t simdSupport();
+
 class FileSys{
     public:
     friend class Grader;
@@ -91,11 +371,75 @@ class FileSys{
     bool updateDiskBlock(File file, int block);
     void changeProbPolicy(prob_t policy);
     void dump() const;
+    // Keeps a blocked Bloom filter of the stored (name, block) keys which getFile
+    // consults before probing, so most lookups of absent keys end after touching
+    // a single cache line. Calling it again resizes the filter.
+    void enableMissFilter(float fpRate = DEFFILTERFPR, int maxBytes = DEFFILTERBYTES);
+    void disableMissFilter();
+    FilterStats filterStats() const;
+    // Bounds the table to maxEntries files. Once full, insert evicts a victim
+    // chosen by the CLOCK algorithm instead of failing, and calls onEvict with it
+    // and context. The capacity is fixed from here on, so the table no longer
+    // rehashes to grow.
+    void enableCacheMode(int maxEntries, evict_fn onEvict = nullptr, void* context = nullptr);
+    bool isCacheMode() const {return m_cacheMax > 0;}
+    long numEvictions() const {return m_numEvictions;}
+    // Returns a consistent read-only view of the current table, the caller deletes it.
+    // Taking it costs one reference per segment, segments are copied only when
+    // the table later writes to them. Must be called by the thread writing the table.
+    FileSysSnapshot* snapshot();
+    // Keeps an ordered index over (name, block) in sync with every change to the
+    // table, so files can be listed by name prefix or range without a full scan.
+    void enableOrderedIndex();
+    void disableOrderedIndex();
+    // Streaming cursors over the index, invalidated by the next change to the table.
+    // They throw logic_error if the ordered index is not enabled.
+    NameIndex::Iterator listPrefix(const string& prefix) const;
+    NameIndex::Iterator listRange(const string& lo, const string& hi) const; // names in [lo, hi)
+    // Records every insert, remove, getFile and updateDiskBlock call to a binary
+    // trace file until stopTrace, returns false if the file cannot be created.
+    bool startTrace(const string& path);
+    void stopTrace();
+    // Chooses how the slot array is allocated from the next rehash on (the current
+    // table is rebuilt right away). Arrays of at least HUGEPAGE bytes are mapped with
+    // mmap, backed by transparent huge pages or by reserved hugetlb pages, and either
+    // interleaved across NUMA nodes or zeroed in parallel so first touch spreads them.
+    // Smaller arrays and segments copied for snapshots stay on the heap.
+    void setAllocPolicy(page_t pages, numa_t numa = NUMANONE);
+    // Pages actually backing the current table, hugetlb falls back to THP when
+    // no huge pages are reserved and everything falls back to the heap if mmap fails
+    page_t tablePages() const;
+    // Builds a minimal perfect hash over the stored files, packs them into one array
+    // of exactly one slot per file and releases the table. Until thaw, getFile reads
+    // one slot and compares it, and changes to the table throw logic_error.
+    // Returns false, leaving the table mutable, if the hash could not be built.
+    bool freeze();
+    // Moves the files back into a mutable table of the capacity it had before freeze
+    void thaw();
+    bool isFrozen() const {return m_frozen != nullptr;}
+    // Hashes names with batch wherever many keys are handled at once: rehashing,
+    // thawing, insertBatch and getFiles. batch must return the same hashes as the
+    // table's hash function, e.g. hashCode33Batch for hashCode33.
+    void setBatchHash(batch_hash_fn batch);
+    // Inserts count files, returns how many were inserted
+    int insertBatch(const File* files, int count);
+    // Looks up count (name, block) keys, found[i] tells whether key i is stored
+    // and files[i] then holds it. Returns the number of keys found.
+    int getFiles(const string* names, const int* blocks, int count, File* files, bool* found) const;
+    // Keeps a DigestTree of the stored keys in sync with every change to the table,
+    // for comparing replicas. It costs a copy of every key, as the ordered index does.
+    void enableDigests();
+    void disableDigests();
+    // The digest tree, throws logic_error if digests are not enabled
+    const DigestTree& digests() const;
+    // Files only in this table and only in other, looking only at the ranges
+    // whose digests differ. Both tables need digests enabled.
+    void diff(const FileSys& other, vector<File>& onlyHere, vector<File>& onlyThere) const;
     private:
     hash_fn    m_hash;          // hash function
     prob_t     m_newPolicy;     // stores the change of policy request
 
-    File**     m_currentTable;  // hash table
+    Segment**  m_currentTable;  // hash table, split into copy-on-write segments
     int        m_currentCap;    // hash table size (capacity)
     int        m_currentSize;   // current number of entries
                                 // m_currentSize includes deleted entries 
@@ -109,10 +453,41 @@ class FileSys{
     int        m_oldNumDeleted; // number of deleted entries
     prob_t     m_oldProbing;    // collision handling policy
 
+    MissFilter*  m_filter;      // optional negative-lookup filter, nullptr if disabled
+    float      m_filterFpr;     // false-positive rate requested for the filter
+    int        m_filterBudget;  // memory budget requested for the filter
+    int        m_filterStale;   // removed keys still set in the filter
+    mutable long m_filterLookups;  // lookup counters, updated by the const getFile
+    mutable long m_filterRejected;
+    mutable long m_filterFalsePos;
+
+    int        m_cacheMax;      // entry bound in cache mode, 0 if the table grows
+    evict_fn   m_onEvict;       // eviction callback in cache mode
+    void*      m_evictContext;  // passed back to the eviction callback
+    unsigned char* m_refBits;   // CLOCK reference bit per slot, allocated in cache mode
+    int        m_clockHand;     // next slot the CLOCK hand examines
+    long       m_numEvictions;  // number of files evicted in cache mode
+
+    NameIndex* m_index;         // optional ordered index, nullptr if disabled
+    TraceWriter* m_trace;       // trace being recorded, nullptr if none
+    page_t     m_pages;         // allocation policy of the slot array
+    numa_t     m_numa;
+    PerfectHash* m_frozen;      // files while frozen, m_currentTable is nullptr then
+    batch_hash_fn m_batchHash;  // optional batch version of m_hash
+    DigestTree*  m_digests;     // optional replica digests, nullptr if disabled
+
     int        m_transferIndex; // this can be used as a temporary place holder
                                 // during incremental transfer to scanning the table
     int hash(std::string name, int block) const; // Declare hash function
 
+    // the slot at index, for reading
+    File* slotAt(int index) const {
+        return m_currentTable[index / SEGMENTSLOTS]->m_slots[index % SEGMENTSLOTS];
+    }
+
+    // the slot at index, for writing, copies the segment first if a snapshot shares it
+    File*& writableSlot(int index);
+
  // Private helper functions
     bool isPrime(int number);
     int findNextPrime(int current);
@@ -153,6 +528,27 @@ class FileSys{
     // Helper function to update rehashing criteria
     void updateRehashCriteria();
 
+    // Helper function to rebuild the miss filter from the current table
+    void rebuildFilter();
+
+    // Helper function that throws logic_error while the table is frozen
+    void checkMutable() const;
+
+    // Helper functions taking the hash of the name from the caller, so batches hash together
+    bool insertHashed(const File& file, unsigned int hash);
+    const File* findHashed(const string& name, int block, unsigned int hash) const;
+    void hashNames(const string* const* names, int count, unsigned int* hashes) const;
+
+    // Helper function to move the live entries into a new table of the given capacity,
+    // false if they do not all fit and the table is left unchanged
+    bool rehashTo(int newCap);
+
+    // Helper function to delete the file at index and leave a tombstone
+    void eraseSlot(int index);
+
+    // Helper function to evict one file chosen by the CLOCK hand
+    void evictOne();
+
     // Helper function to print hash table details
     void printTable(File** table, int tableCap) const;
      prob_t m_probePolicy;
@@ -165,4 +561,62 @@ class FileSys{
 
 };
 
+// A compact storage mode with the same interface as FileSys for large tables of
+// short names. Each slot is one packed 64-bit word next to a 32-bit offset into
+// a shared name arena, instead of a pointer to a heap File holding a string.
+// The packed word holds
+//     bits  0-19  disk block, DISKMAX fits in 20 bits
+//     bits 20-21  slot state (empty, live, deleted)
+//     bit  22     the used flag of the file
+//     bits 32-63  hash tag, the full hash of the name, compared before the name
+// Names are stored in the arena with a varint length prefix. The capacity is not
+// bounded by MAXPRIME.
+class CompactFileSys{
+    public:
+    friend class Grader;
+    friend class Tester;
+    CompactFileSys(int size, hash_fn hash, prob_t probing);
+    ~CompactFileSys();
+    float lambda() const;
+    float deletedRatio() const;
+    // fails for duplicates and for blocks outside [0, 2^20)
+    bool insert(File file);
+    bool remove(File file);
+    const File getFile(string name, int block) const;
+    bool updateDiskBlock(File file, int block);
+    int size() const {return m_size;}
+    int capacity() const {return m_cap;}
+    // bytes held by the slot arrays and the name arena
+    long memoryBytes() const;
+    void dump() const;
+    private:
+    static const int BLOCKBITS = 20;
+    static const uint64_t BLOCKMASK = (1ULL << BLOCKBITS) - 1;
+    static const int STATESHIFT = 20;
+    static const uint64_t EMPTY = 0, LIVE = 1, DELETED = 2;
+    static const uint64_t USEDBIT = 1ULL << 22;
+    static const int TAGSHIFT = 32;
+
+    hash_fn    m_hash;          // hash function
+    prob_t     m_probing;       // collision handling policy (quadratic, as in FileSys)
+    uint64_t*  m_words;         // packed slot words
+    uint32_t*  m_offsets;       // arena offset of the name of each live slot
+    int        m_cap;           // number of slots
+    int        m_size;          // number of live entries
+    int        m_numDeleted;    // number of deleted slots
+    vector<char> m_arena;       // length-prefixed names, compacted on rehash
+    long       m_arenaGarbage;  // arena bytes of removed names
+
+    static uint64_t state(uint64_t word) {return (word >> STATESHIFT) & 3;}
+    static int block(uint64_t word) {return static_cast<int>(word & BLOCKMASK);}
+    static uint64_t pack(int block, bool used, unsigned int tag);
+    // compares the arena name at offset with name
+    bool nameEquals(uint32_t offset, const string& name) const;
+    string nameAt(uint32_t offset) const;
+    uint32_t appendName(const string& name);
+    // index of the live slot holding (name, block), -1 if absent
+    int find(const string& name, int block) const;
+    void rehash(int newCap);
+};
+
 #endif
\ No newline at end of file
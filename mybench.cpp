@@ -0,0 +1,599 @@
+// CMSC 341 - Fall 2024 - Project 4
+// Benchmarks for FileSys, build with
+//     g++ -O2 -std=c++17 -pthread mybench.cpp filesys.cpp -o mybench
+// and run ./mybench [name], with no name every benchmark runs.
+#include "filesys.h"
+#include "random.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <malloc.h>
+#include <stdexcept>
+#include <vector>
+using namespace std;
+
+unsigned int hashCode(const string str) {
+   unsigned int val = 0 ;
+   const unsigned int thirtyThree = 33 ;  // magic number from textbook
+   for (unsigned int i = 0 ; i < str.length(); i++)
+      val = val * thirtyThree + str[i] ;
+   return val ;
+}
+
+// Seconds elapsed since start
+double elapsed(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Random file names of the given length range, unique by construction (numeric suffix)
+vector<string> makeNames(int count, int minLen, int maxLen, int seed) {
+    Random rndChar(97, 122);
+    Random rndLen(minLen, maxLen);
+    rndChar.setSeed(seed);
+    rndLen.setSeed(seed + 1);
+    vector<string> names;
+    names.reserve(count);
+    for (int i = 0; i < count; i++) {
+        names.push_back(rndChar.getRandString(rndLen.getRandNum()) + to_string(i));
+    }
+    return names;
+}
+
+// Lookups at a 90% miss ratio, with and without the negative-lookup filter.
+// The table is churned first so misses also walk tombstones.
+void benchMissFilter() {
+    const int LIVE = 700;           // the table caps at MAXPRIME slots
+    const int CHURN = 2000;         // inserted and removed again, leaving tombstones
+    const int LOOKUPS = 200000;
+    const float MISSRATIO = 0.9;
+    cout << "== miss filter: " << LOOKUPS << " lookups, " << MISSRATIO * 100 << "% misses ==\n";
+
+    vector<string> live = makeNames(LIVE, 6, 16, 1);
+    vector<string> churn = makeNames(CHURN, 6, 16, 2);
+    vector<string> absent = makeNames(LOOKUPS, 6, 16, 3);
+
+    for (int withFilter = 0; withFilter < 2; withFilter++) {
+        Random rndPick(0, LIVE - 1);
+        Random rndMiss(0, 99);
+        FileSys filesys(MINPRIME, hashCode, QUADRATIC);
+        if (withFilter) {
+            filesys.enableMissFilter(DEFFILTERFPR, DEFFILTERBYTES);
+        }
+        for (int i = 0; i < LIVE; i++) {
+            filesys.insert(File(live[i], DISKMIN + i, true));
+        }
+        for (int i = 0; i < CHURN; i++) {
+            File file(churn[i], DISKMIN + i, true);
+            filesys.insert(file);
+            filesys.remove(file);
+        }
+
+        long hits = 0;
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < LOOKUPS; i++) {
+            try {
+                if (rndMiss.getRandNum() < MISSRATIO * 100) {
+                    filesys.getFile(absent[i], DISKMIN + i);
+                } else {
+                    int pick = rndPick.getRandNum();
+                    filesys.getFile(live[pick], DISKMIN + pick);
+                }
+                hits++;
+            } catch (const std::runtime_error& e) {
+                // a miss
+            }
+        }
+        double secs = elapsed(start);
+        cout << (withFilter ? "filter on : " : "filter off: ") << secs * 1e9 / LOOKUPS << " ns/lookup, "
+             << hits << " hits\n";
+        if (withFilter) {
+            FilterStats stats = filesys.filterStats();
+            cout << "  bytes " << stats.bytes << " (budget " << stats.budget << "), hashes " << stats.numHashes
+                 << ", target fpr " << stats.targetFpr << ", expected fpr " << stats.expectedFpr << "\n"
+                 << "  rejected " << stats.rejected << " of " << stats.lookups
+                 << ", false positives " << stats.falsePositives << "\n";
+        }
+    }
+}
+
+// Samples ranks in [0, n) with probability proportional to 1 / (rank + 1)^skew
+class Zipf {
+public:
+    Zipf(int n, double skew, int seed) : m_cdf(n), m_generator(seed), m_uniReal(0.0, 1.0) {
+        double sum = 0;
+        for (int i = 0; i < n; i++) {
+            sum += 1.0 / pow(i + 1.0, skew);
+            m_cdf[i] = sum;
+        }
+        for (int i = 0; i < n; i++) {
+            m_cdf[i] /= sum;
+        }
+    }
+    int next() {
+        double u = m_uniReal(m_generator);
+        int rank = lower_bound(m_cdf.begin(), m_cdf.end(), u) - m_cdf.begin();
+        return rank < (int)m_cdf.size() ? rank : (int)m_cdf.size() - 1;
+    }
+private:
+    vector<double> m_cdf;
+    std::mt19937 m_generator;
+    std::uniform_real_distribution<double> m_uniReal;
+};
+
+// Counts the files evicted into the long at context
+void onEvict(const File&, void* context) {
+    (*static_cast<long*>(context))++;
+}
+
+// Cache mode in front of a simulated backing store: every miss fills the cache.
+// Reports hit ratio and throughput under Zipfian key popularity.
+void benchCache() {
+    const int KEYS = 200000;
+    const int REQUESTS = 500000;
+    cout << "== cache mode: " << REQUESTS << " requests over " << KEYS << " keys ==\n";
+    vector<string> names = makeNames(KEYS, 6, 16, 4);
+    // keys are popular in a random order, not in name order
+    vector<int> order;
+    Random(0, KEYS - 1, SHUFFLE).getShuffle(order);
+
+    double skews[] = {0.8, 0.99, 1.2};
+    double fractions[] = {0.01, 0.05, 0.2};
+    for (double skew : skews) {
+        for (double fraction : fractions) {
+            int cacheSize = static_cast<int>(KEYS * fraction);
+            FileSys cache(MINPRIME, hashCode, QUADRATIC);
+            long evictions = 0;
+            cache.enableCacheMode(cacheSize, onEvict, &evictions);
+            Zipf zipf(KEYS, skew, 5);
+            long hits = 0;
+            auto start = chrono::steady_clock::now();
+            for (int i = 0; i < REQUESTS; i++) {
+                int key = order[zipf.next()];
+                try {
+                    cache.getFile(names[key], DISKMIN + key);
+                    hits++;
+                } catch (const std::runtime_error& e) {
+                    cache.insert(File(names[key], DISKMIN + key, true));
+                }
+            }
+            double secs = elapsed(start);
+            cout << "skew " << skew << ", cache " << fraction * 100 << "% of keys: hit ratio "
+                 << static_cast<double>(hits) / REQUESTS << ", " << REQUESTS / secs / 1e6 << " Mops/s, "
+                 << evictions << " evictions\n";
+        }
+    }
+}
+
+// Bytes currently allocated from the heap (glibc)
+long heapBytes() {
+    struct mallinfo2 info = mallinfo2();
+    return static_cast<long>(info.uordblks + info.hblkhd);
+}
+
+// A short (at most 15 character) name for i, regenerated instead of stored
+string shortName(int i) {
+    unsigned long long x = (i + 1) * 0x9E3779B97F4A7C15ULL;
+    x ^= x >> 31;
+    string name(4 + x % 5, 'a');
+    for (char& ch : name) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        ch = 'a' + (x >> 59) % 26;
+    }
+    return name + to_string(i);
+}
+
+// Bytes per entry of the pointer table and of the compact packed table at 10M
+// entries, for short names (kept inline by std::string) and longer path-like
+// names. Cache mode holds the pointer table since a growing FileSys stops at
+// MAXPRIME slots.
+void benchCompact() {
+    const int COMPACTENTRIES = 10000000;
+    const int LOOKUPS = 1000000;
+    const string suffixes[] = {"", "/src/module.cpp"};
+    cout << "== compact slots: bytes per entry ==\n";
+
+    for (const string& suffix : suffixes) {
+        cout << (suffix.empty() ? "short names (up to 15 chars)\n" : "long names (up to 30 chars)\n");
+        double pointerBytes;
+        {
+            long before = heapBytes();
+            FileSys filesys(MINPRIME, hashCode, QUADRATIC);
+            filesys.enableCacheMode(COMPACTENTRIES);
+            for (int i = 0; i < COMPACTENTRIES; i++) {
+                filesys.insert(File(shortName(i) + suffix, DISKMIN + i % 100000, true));
+            }
+            pointerBytes = static_cast<double>(heapBytes() - before) / COMPACTENTRIES;
+            cout << "  FileSys       : " << COMPACTENTRIES << " entries, "
+                 << pointerBytes << " bytes/entry, load " << filesys.lambda() << "\n";
+        }
+        long before = heapBytes();
+        CompactFileSys compact(MINPRIME, hashCode, QUADRATIC);
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < COMPACTENTRIES; i++) {
+            compact.insert(File(shortName(i) + suffix, DISKMIN + i % 100000, true));
+        }
+        double insertSecs = elapsed(start);
+        long bytes = heapBytes() - before;
+        cout << "  CompactFileSys: " << compact.size() << " entries, "
+             << static_cast<double>(bytes) / compact.size() << " bytes/entry (heap), "
+             << static_cast<double>(compact.memoryBytes()) / compact.size() << " bytes/entry (reported), load "
+             << compact.lambda() << ", " << pointerBytes * compact.size() / bytes << "x smaller\n";
+
+        Random rndPick(0, COMPACTENTRIES - 1);
+        long found = 0;
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < LOOKUPS; i++) {
+            int pick = rndPick.getRandNum();
+            found += compact.getFile(shortName(pick) + suffix, DISKMIN + pick % 100000).getDiskBlock() != 0;
+        }
+        double lookupSecs = elapsed(start);
+        cout << "  " << insertSecs * 1e9 / COMPACTENTRIES << " ns/insert, "
+             << lookupSecs * 1e9 / LOOKUPS << " ns/lookup (including name generation), " << found << " found\n";
+    }
+}
+
+// Prefix and range listings from the ordered index against scanning the
+// whole table and sorting the matches. Cache mode holds the large table
+// since a growing FileSys stops at MAXPRIME slots.
+void benchOrderedIndex() {
+    const int QUERIES = 50;
+    int sizes[] = {100000, 1000000};
+    cout << "== ordered index: " << QUERIES << " prefix and " << QUERIES << " range listings ==\n";
+    for (int size : sizes) {
+        FileSys filesys(MINPRIME, hashCode, QUADRATIC);
+        filesys.enableCacheMode(size);
+        filesys.enableOrderedIndex();
+        for (int i = 0; i < size; i++) {
+            filesys.insert(File(shortName(i), DISKMIN + i % 100000, true));
+        }
+
+        // two-letter prefixes and ranges of the same width
+        Random rndChar(97, 122);
+        vector<string> prefixes;
+        for (int q = 0; q < QUERIES; q++) {
+            prefixes.push_back(rndChar.getRandString(2));
+        }
+        for (int byPrefix = 1; byPrefix >= 0; byPrefix--) {
+            long indexCount = 0;
+            auto start = chrono::steady_clock::now();
+            for (const string& prefix : prefixes) {
+                string hi = prefix + "m";
+                NameIndex::Iterator it = byPrefix ? filesys.listPrefix(prefix) : filesys.listRange(prefix, hi);
+                for (; it.valid(); it.next()) {
+                    indexCount += it.block() != 0;
+                }
+            }
+            double indexSecs = elapsed(start);
+
+            long scanCount = 0;
+            start = chrono::steady_clock::now();
+            FileSysSnapshot* view = filesys.snapshot();
+            for (const string& prefix : prefixes) {
+                string hi = prefix + "m";
+                vector<pair<string, int>> matches;
+                for (int i = 0; i < view->capacity(); i++) {
+                    const File* file = view->fileAt(i);
+                    if (file != nullptr && (byPrefix ? file->getName().compare(0, prefix.size(), prefix) == 0
+                                                     : file->getName() >= prefix && file->getName() < hi)) {
+                        matches.push_back(make_pair(file->getName(), file->getDiskBlock()));
+                    }
+                }
+                sort(matches.begin(), matches.end());
+                scanCount += matches.size();
+            }
+            delete view;
+            double scanSecs = elapsed(start);
+            cout << size << " files, " << (byPrefix ? "listPrefix" : "listRange ") << ": index "
+                 << indexSecs * 1e6 / QUERIES << " us/query, scan and sort " << scanSecs * 1e6 / QUERIES
+                 << " us/query, " << indexCount / QUERIES << " files/query"
+                 << (indexCount == scanCount ? "" : " (MISMATCH)") << "\n";
+        }
+    }
+}
+
+// Anonymous memory of this process backed by transparent huge pages, in MB (Linux)
+long hugePageMB() {
+    ifstream smaps("/proc/self/smaps_rollup");
+    string line;
+    while (getline(smaps, line)) {
+        if (line.compare(0, 14, "AnonHugePages:") == 0) {
+            return atol(line.c_str() + 14) / 1024;
+        }
+    }
+    return 0;
+}
+
+// Random lookups into a large cache-mode table whose slot array is allocated
+// with each policy, the plain heap segments are the baseline
+void benchPages() {
+    const int ENTRIES = 4000000;    // slot array of about 64 MB
+    const int LOOKUPS = 4000000;
+    cout << "== slot array pages: " << ENTRIES << " files, " << LOOKUPS << " random lookups ==\n";
+    vector<string> names;
+    names.reserve(ENTRIES);
+    for (int i = 0; i < ENTRIES; i++) {
+        names.push_back(shortName(i));
+    }
+    vector<int> keys(LOOKUPS);
+    Random rndKey(0, ENTRIES - 1);
+    rndKey.setSeed(7);
+    for (int& key : keys) {
+        key = rndKey.getRandNum();
+    }
+
+    struct Policy {
+        const char* name;
+        page_t pages;
+        numa_t numa;
+    };
+    Policy policies[] = {
+        {"heap segments     ", PAGEDEFAULT, NUMANONE},
+        {"THP               ", PAGETHP, NUMANONE},
+        {"hugetlb           ", PAGEHUGETLB, NUMANONE},
+        {"THP, interleaved  ", PAGETHP, NUMAINTERLEAVE},
+        {"THP, first touch  ", PAGETHP, NUMAFIRSTTOUCH},
+    };
+    const char* backings[] = {"heap", "THP", "hugetlb"};
+    for (const Policy& policy : policies) {
+        FileSys filesys(MINPRIME, hashCode, QUADRATIC);
+        filesys.setAllocPolicy(policy.pages, policy.numa);
+        auto start = chrono::steady_clock::now();
+        filesys.enableCacheMode(ENTRIES);
+        for (int i = 0; i < ENTRIES; i++) {
+            filesys.insert(File(names[i], DISKMIN + i % (DISKMAX - DISKMIN), true));
+        }
+        double buildSecs = elapsed(start);
+        long found = 0;
+        start = chrono::steady_clock::now();
+        for (int key : keys) {
+            found += filesys.getFile(names[key], DISKMIN + key % (DISKMAX - DISKMIN)).getUsed();
+        }
+        double lookupSecs = elapsed(start);
+        cout << policy.name << "(backed by " << backings[filesys.tablePages()] << "): build "
+             << buildSecs << " s, lookup " << lookupSecs * 1e9 / LOOKUPS << " ns/op, "
+             << hugePageMB() << " MB on huge pages"
+             << (found == LOOKUPS ? "" : " (MISSING FILES)") << "\n";
+    }
+}
+
+// Lookups in a table before and after freeze(), and the heap it takes in each state.
+// Growing tables stop at MAXPRIME, so the large table is a cache-mode one (load 1/2).
+// Misses are timed apart since the exception getFile throws costs more than the probe.
+void benchFreeze() {
+    const int LOOKUPS = 2000000;
+    const int MISSES = 200000;
+    int sizes[] = {700, 1000000};
+    cout << "== freeze: " << LOOKUPS << " hits and " << MISSES << " misses ==\n";
+    for (int size : sizes) {
+        vector<string> names;
+        for (int i = 0; i < size + MISSES; i++) {
+            names.push_back(shortName(i)); // names past size are absent
+        }
+        vector<int> keys(LOOKUPS);
+        Random rndKey(0, size - 1);
+        rndKey.setSeed(11);
+        for (int& key : keys) {
+            key = rndKey.getRandNum();
+        }
+
+        long before = heapBytes();
+        FileSys filesys(MINPRIME, hashCode, QUADRATIC);
+        if (size > 750) {
+            filesys.enableCacheMode(size);
+        }
+        for (int i = 0; i < size; i++) {
+            filesys.insert(File(names[i], DISKMIN + i, true));
+        }
+        // ns per hit and per miss
+        auto lookups = [&]() {
+            auto start = chrono::steady_clock::now();
+            long blocks = 0;
+            for (int key : keys) {
+                blocks += filesys.getFile(names[key], DISKMIN + key).getDiskBlock();
+            }
+            double hitSecs = elapsed(start);
+            start = chrono::steady_clock::now();
+            for (int i = size; i < size + MISSES; i++) {
+                try {
+                    blocks += filesys.getFile(names[i], DISKMIN + i).getDiskBlock();
+                } catch (const std::runtime_error& e) {
+                }
+            }
+            double missSecs = elapsed(start);
+            return make_pair(hitSecs * 1e9 / LOOKUPS, missSecs * 1e9 / MISSES);
+        };
+        long tableBytes = heapBytes() - before;
+        pair<double, double> table = lookups();
+
+        auto start = chrono::steady_clock::now();
+        filesys.freeze();
+        double freezeSecs = elapsed(start);
+        long frozenBytes = heapBytes() - before;
+        pair<double, double> frozen = lookups();
+
+        start = chrono::steady_clock::now();
+        filesys.thaw();
+        double thawSecs = elapsed(start);
+        cout << size << " files: table " << table.first << "/" << table.second << " ns per hit/miss, "
+             << tableBytes / size << " B/file; frozen " << frozen.first << "/" << frozen.second
+             << " ns per hit/miss, " << frozenBytes / size << " B/file; freeze " << freezeSecs * 1e3
+             << " ms, thaw " << thawSecs * 1e3 << " ms\n";
+    }
+}
+
+// Names hashed per second by hashCode and by each batch kernel, for short names
+// and long path-like ones, over a set that stays in cache and over a large one,
+// and a bulk load with and without batch hashing
+void benchSimdHash() {
+    const int NAMES = 1000000;
+    const int HOTNAMES = 4096;
+    const long HASHES = 20000000;   // names hashed per measurement
+    const char* kernelNames[] = {"scalar", "SSE2", "AVX2", "AVX-512"};
+    cout << "== batch hashing: widest kernel " << kernelNames[simdSupport()] << " ==\n";
+    int lengths[][2] = {{6, 16}, {48, 96}};   // plus the numeric suffix of makeNames
+    for (auto& length : lengths) {
+        vector<string> names = makeNames(NAMES, length[0], length[1], 9);
+        const char* label = (length[0] < 16) ? "short names" : "long names";
+        vector<const string*> pointers;
+        long bytes = 0;
+        for (const string& name : names) {
+            pointers.push_back(&name);
+            bytes += name.size();
+        }
+        vector<unsigned int> expected(NAMES);
+        for (int i = 0; i < NAMES; i++) {
+            expected[i] = hashCode(names[i]);
+        }
+        int setSizes[] = {HOTNAMES, NAMES};
+        for (int setSize : setSizes) {
+            long rounds = HASHES / setSize;
+            double bytesPerName = static_cast<double>(bytes) / NAMES;
+            cout << label << " (" << bytesPerName << " bytes), " << setSize << " names:";
+            // hashCode as the table calls it, through hash_fn
+            hash_fn single = hashCode;
+            vector<unsigned int> hashes(setSize);
+            auto start = chrono::steady_clock::now();
+            for (long round = 0; round < rounds; round++) {
+                for (int i = 0; i < setSize; i++) {
+                    hashes[i] = single(names[i]);
+                }
+            }
+            double secs = elapsed(start);
+            cout << " hashCode " << rounds * setSize / secs / 1e6 << " M/s";
+            for (int kernel = SIMDSCALAR; kernel <= simdSupport(); kernel++) {
+                start = chrono::steady_clock::now();
+                for (long round = 0; round < rounds; round++) {
+                    for (int first = 0; first < setSize; first += HASHBATCH) {
+                        hashCode33BatchWith(static_cast<simd_t>(kernel), pointers.data() + first,
+                                            min(HASHBATCH, setSize - first), hashes.data() + first);
+                    }
+                }
+                secs = elapsed(start);
+                cout << ", " << kernelNames[kernel] << " " << rounds * setSize / secs / 1e6 << " M/s"
+                     << (equal(hashes.begin(), hashes.end(), expected.begin()) ? "" : " (MISMATCH)");
+            }
+            // hashCode33Batch picks scalar or the widest kernel per batch
+            start = chrono::steady_clock::now();
+            for (long round = 0; round < rounds; round++) {
+                for (int first = 0; first < setSize; first += HASHBATCH) {
+                    hashCode33Batch(pointers.data() + first, min(HASHBATCH, setSize - first), hashes.data() + first);
+                }
+            }
+            secs = elapsed(start);
+            cout << ", hashCode33Batch " << rounds * setSize / secs / 1e6 << " M/s"
+                 << (equal(hashes.begin(), hashes.end(), expected.begin()) ? "" : " (MISMATCH)");
+            cout << "\n";
+        }
+
+        // Bulk load of a cache-mode table, one file at a time and in batches
+        vector<File> files;
+        for (int i = 0; i < NAMES; i++) {
+            files.push_back(File(names[i], DISKMIN + i % (DISKMAX - DISKMIN), true));
+        }
+        for (int batched = 0; batched < 2; batched++) {
+            FileSys filesys(MINPRIME, hashCode, QUADRATIC);
+            filesys.enableCacheMode(NAMES);
+            if (batched) {
+                filesys.setBatchHash(hashCode33Batch);
+            }
+            auto start = chrono::steady_clock::now();
+            if (batched) {
+                filesys.insertBatch(files.data(), NAMES);
+            } else {
+                for (const File& file : files) {
+                    filesys.insert(file);
+                }
+            }
+            double secs = elapsed(start);
+            cout << label << ": bulk load of " << NAMES << " files with "
+                 << (batched ? "insertBatch " : "insert      ") << NAMES / secs / 1e6 << " M files/s\n";
+        }
+    }
+}
+
+// Cost of finding the differences between two replicas with digests against
+// comparing every file, as the divergence grows, and the insert overhead of
+// keeping the digests current
+void benchDigest() {
+    int sizes[] = {100000, 1000000};
+    int divergences[] = {10, 1000, 100000};
+    cout << "== digest: " << DIGESTRANGES << " ranges ==\n";
+    for (int size : sizes) {
+        FileSys replicaA(MINPRIME, hashCode, QUADRATIC);
+        FileSys replicaB(MINPRIME, hashCode, QUADRATIC);
+        replicaA.enableCacheMode(size);
+        replicaB.enableCacheMode(size);
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < size; i++) {
+            replicaA.insert(File(shortName(i), DISKMIN + i % (DISKMAX - DISKMIN), true));
+        }
+        double plainSecs = elapsed(start);
+        replicaB.enableDigests();
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < size; i++) {
+            replicaB.insert(File(shortName(i), DISKMIN + i % (DISKMAX - DISKMIN), true));
+        }
+        double digestSecs = elapsed(start);
+        replicaA.enableDigests();
+        cout << size << " files: insert " << plainSecs * 1e9 / size << " ns, with digests "
+             << digestSecs * 1e9 / size << " ns\n";
+
+        vector<int> allRanges(DIGESTRANGES);
+        for (int i = 0; i < DIGESTRANGES; i++) {
+            allRanges[i] = i;
+        }
+        int diverged = 0;
+        for (int divergence : divergences) {
+            // B loses files A keeps, spread evenly over the names
+            for (; diverged < divergence; diverged++) {
+                int i = static_cast<int>(static_cast<long>(diverged) * size / divergences[2]);
+                replicaB.remove(File(shortName(i), DISKMIN + i % (DISKMAX - DISKMIN), true));
+            }
+            vector<File> onlyA, onlyB;
+            start = chrono::steady_clock::now();
+            vector<int> ranges = replicaA.digests().diffRanges(replicaB.digests());
+            vector<File> exchanged = replicaA.digests().entries(ranges);
+            DigestTree::diffEntries(exchanged, replicaB.digests().entries(ranges), onlyA, onlyB);
+            double diffSecs = elapsed(start);
+            size_t found = onlyA.size();
+
+            start = chrono::steady_clock::now();
+            DigestTree::diffEntries(replicaA.digests().entries(allRanges), replicaB.digests().entries(allRanges),
+                                    onlyA, onlyB);
+            double fullSecs = elapsed(start);
+            cout << "  " << divergence << " differing: digests " << diffSecs * 1e3 << " ms over "
+                 << ranges.size() << " ranges, " << exchanged.size() << " files sent; compare all "
+                 << fullSecs * 1e3 << " ms, " << size << " files sent; found " << found << "/" << onlyA.size() << "\n";
+        }
+    }
+}
+
+struct Benchmark {
+    const char* name;
+    void (*run)();
+};
+
+int main(int argc, char* argv[]) {
+    Benchmark benchmarks[] = {
+        {"missfilter", benchMissFilter},
+        {"cache", benchCache},
+        {"compact", benchCompact},
+        {"index", benchOrderedIndex},
+        {"pages", benchPages},
+        {"freeze", benchFreeze},
+        {"simdhash", benchSimdHash},
+        {"digest", benchDigest},
+    };
+    bool ran = false;
+    for (const Benchmark& bench : benchmarks) {
+        if (argc < 2 || strcmp(argv[1], bench.name) == 0) {
+            bench.run();
+            ran = true;
+        }
+    }
+    if (!ran) {
+        cout << "Unknown benchmark: " << argv[1] << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,229 @@
+// CMSC 341 - Fall 2024 - Project 4
+// Trace generator and replay load driver for FileSys, build with
+//     g++ -O2 -std=c++17 -pthread myreplay.cpp filesys.cpp -o myreplay
+// Traces are recorded by FileSys::startTrace, or synthesized with
+//     ./myreplay gen <trace> [ops] [keys] [uniform|normal]
+// and replayed against a fresh FileSys with
+//     ./myreplay run <trace> [--rate opsPerSec] [--threads n] [--cache entries]
+// Without --rate the replay is closed-loop at maximum rate, with it every
+// operation has a scheduled start and latency is measured from that start,
+// so time spent queueing behind slow operations is counted.
+#include "filesys.h"
+#include "random.h"
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+using namespace std;
+
+unsigned int hashCode(const string str) {
+   unsigned int val = 0 ;
+   const unsigned int thirtyThree = 33 ;  // magic number from textbook
+   for (unsigned int i = 0 ; i < str.length(); i++)
+      val = val * thirtyThree + str[i] ;
+   return val ;
+}
+
+string namesDB[6] = {"driver.cpp", "test.cpp", "test.h", "info.txt", "mydocument.docx", "tempsheet.xlsx"};
+
+// Synthesize a trace: every key is inserted once, then ops are drawn from a
+// mix of 70% getFile, 10% insert, 10% updateDiskBlock and 10% remove over keys
+// chosen with a uniform or normal distribution. Blocks follow the updates so
+// lookups of live files hit.
+int generate(const string& path, int ops, int keys, RANDOM keyDist) {
+    TraceWriter trace(path);
+    if (!trace.good()) {
+        cout << "Cannot create " << path << endl;
+        return 1;
+    }
+    Random rndKey = (keyDist == NORMAL) ? Random(0, keys - 1, NORMAL, keys / 2, keys / 6)
+                                        : Random(0, keys - 1, UNIFORMINT);
+    rndKey.setSeed(10);
+    Random rndOp(0, 99);
+    Random rndID(DISKMIN, DISKMAX);
+    vector<int> blocks(keys);
+    for (int key = 0; key < keys; key++) {
+        blocks[key] = DISKMIN + key;
+        trace.write(TRACEINSERT, namesDB[key % 6] + to_string(key), blocks[key]);
+    }
+    for (int i = 0; i < ops; i++) {
+        int key = rndKey.getRandNum();
+        string name = namesDB[key % 6] + to_string(key);
+        int op = rndOp.getRandNum();
+        if (op < 70) {
+            trace.write(TRACEGET, name, blocks[key]);
+        } else if (op < 80) {
+            trace.write(TRACEINSERT, name, blocks[key]);
+        } else if (op < 90) {
+            int block = rndID.getRandNum();
+            trace.write(TRACEUPDATE, name, blocks[key], block);
+            blocks[key] = block;
+        } else {
+            trace.write(TRACEREMOVE, name, blocks[key]);
+        }
+    }
+    cout << "Wrote " << trace.count() << " records to " << path << endl;
+    return 0;
+}
+
+// Apply one record, true if the operation succeeded (found, inserted, ...)
+bool applyRecord(FileSys& filesys, const TraceRecord& record) {
+    switch (record.m_op) {
+    case TRACEINSERT:
+        return filesys.insert(File(record.m_name, record.m_block, true));
+    case TRACEREMOVE:
+        return filesys.remove(File(record.m_name, record.m_block, true));
+    case TRACEUPDATE:
+        return filesys.updateDiskBlock(File(record.m_name, record.m_block, true), record.m_newBlock);
+    default:
+        try {
+            filesys.getFile(record.m_name, record.m_block);
+            return true;
+        } catch (const std::runtime_error& e) {
+            return false;
+        }
+    }
+}
+
+// Wait for an operation's scheduled start. Sleeping all the way would add the
+// thread's wake-up delay, tens of microseconds, to every latency sample, so
+// sleep only until shortly before and spin the rest, yielding so spinning
+// threads do not starve the others when there are more threads than CPUs.
+// A start already in the past returns at once.
+void waitUntil(chrono::steady_clock::time_point scheduled) {
+    const auto SPINWINDOW = chrono::microseconds(200);
+    if (scheduled - chrono::steady_clock::now() > SPINWINDOW) {
+        std::this_thread::sleep_until(scheduled - SPINWINDOW);
+    }
+    while (chrono::steady_clock::now() < scheduled) {
+        std::this_thread::yield();
+    }
+}
+
+int replay(const string& path, double rate, int threads, int cacheEntries) {
+    TraceReader trace(path);
+    if (!trace.good()) {
+        cout << "Cannot read trace " << path << endl;
+        return 1;
+    }
+    vector<TraceRecord> records;
+    TraceRecord record;
+    while (trace.next(record)) {
+        records.push_back(record);
+    }
+
+    FileSys filesys(MINPRIME, hashCode, QUADRATIC);
+    if (cacheEntries > 0) {
+        filesys.enableCacheMode(cacheEntries);
+    }
+    // FileSys is not thread-safe, threads share it under one lock
+    std::mutex lock;
+    vector<vector<long>> latencies(threads);
+    vector<long> successes(threads, 0);
+
+    // Records are dealt by name so every file sees its operations in trace order,
+    // a remove or update reordered before the insert it depends on would miss
+    vector<vector<size_t>> shares(threads);
+    for (size_t i = 0; i < records.size(); i++) {
+        shares[hashCode(records[i].m_name) % threads].push_back(i);
+    }
+
+    auto start = chrono::steady_clock::now();
+    vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(std::thread([&, t]() {
+            vector<long>& mine = latencies[t];
+            mine.reserve(shares[t].size());
+            for (size_t i : shares[t]) {
+                auto begin = chrono::steady_clock::now();
+                if (rate > 0) {
+                    auto scheduled = start + chrono::nanoseconds(static_cast<long>(i * 1e9 / rate));
+                    waitUntil(scheduled);
+                    begin = scheduled;
+                }
+                bool ok;
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    ok = applyRecord(filesys, records[i]);
+                }
+                auto end = chrono::steady_clock::now();
+                mine.push_back(chrono::duration_cast<chrono::nanoseconds>(end - begin).count());
+                successes[t] += ok;
+            }
+        }));
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    vector<long> all;
+    long succeeded = 0;
+    for (int t = 0; t < threads; t++) {
+        all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+        succeeded += successes[t];
+    }
+    if (all.empty()) {
+        cout << "Empty trace" << endl;
+        return 1;
+    }
+    sort(all.begin(), all.end());
+    auto percentile = [&](double p) {
+        size_t index = static_cast<size_t>(ceil(p * all.size()));
+        return all[index == 0 ? 0 : index - 1] / 1000.0;
+    };
+    cout << records.size() << " ops on " << threads << " thread(s), "
+         << (rate > 0 ? "open-loop at " + to_string(static_cast<long>(rate)) + " ops/s" : string("closed-loop")) << "\n"
+         << "throughput " << records.size() / secs << " ops/s, " << succeeded << " succeeded\n"
+         << "latency us: p50 " << percentile(0.50) << ", p99 " << percentile(0.99)
+         << ", p99.9 " << percentile(0.999) << ", max " << all.back() / 1000.0 << endl;
+    return 0;
+}
+
+int usage() {
+    cout << "usage: myreplay gen <trace> [ops] [keys] [uniform|normal]\n"
+         << "       myreplay run <trace> [--rate opsPerSec] [--threads n] [--cache entries]" << endl;
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        return usage();
+    }
+    string command = argv[1];
+    string path = argv[2];
+    if (command == "gen") {
+        int ops = (argc > 3) ? atoi(argv[3]) : 1000000;
+        int keys = (argc > 4) ? atoi(argv[4]) : 500; // a growing FileSys holds about 750 files
+        RANDOM keyDist = (argc > 5 && strcmp(argv[5], "normal") == 0) ? NORMAL : UNIFORMINT;
+        if (ops < 0 || keys < 1) {
+            return usage();
+        }
+        return generate(path, ops, keys, keyDist);
+    }
+    if (command == "run") {
+        double rate = 0;
+        int threads = 1;
+        int cacheEntries = 0;
+        for (int i = 3; i < argc; i += 2) {
+            if (i + 1 >= argc) {
+                return usage(); // Flag without a value
+            } else if (strcmp(argv[i], "--rate") == 0) {
+                rate = atof(argv[i + 1]);
+            } else if (strcmp(argv[i], "--threads") == 0) {
+                threads = atoi(argv[i + 1]);
+            } else if (strcmp(argv[i], "--cache") == 0) {
+                cacheEntries = atoi(argv[i + 1]);
+            } else {
+                return usage();
+            }
+        }
+        if (threads < 1) {
+            return usage();
+        }
+        return replay(path, rate, threads, cacheEntries);
+    }
+    return usage();
+}
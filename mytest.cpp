@@ -1,137 +1,13 @@
 // CMSC 341 - Fall 2024 - Project 4
 #include "filesys.h"
+#include "random.h"
 #include <math.h>
 #include <algorithm>
 #include <random>
+#include <thread>
+#include <atomic>
 #include <vector>
 using namespace std;
-enum RANDOM {UNIFORMINT, UNIFORMREAL, NORMAL, SHUFFLE};
-class Random {
-public:
-    Random(){}
-    Random(int min, int max, RANDOM type=UNIFORMINT, int mean=50, int stdev=20) : m_min(min), m_max(max), m_type(type)
-    {
-        if (type == NORMAL){
-            //the case of NORMAL to generate integer numbers with normal distribution
-            m_generator = std::mt19937(m_device());
-            //the data set will have the mean of 50 (default) and standard deviation of 20 (default)
-            //the mean and standard deviation can change by passing new values to constructor 
-            m_normdist = std::normal_distribution<>(mean,stdev);
-        }
-        else if (type == UNIFORMINT) {
-            //the case of UNIFORMINT to generate integer numbers
-            // Using a fixed seed value generates always the same sequence
-            // of pseudorandom numbers, e.g. reproducing scientific experiments
-            // here it helps us with testing since the same sequence repeats
-            m_generator = std::mt19937(10);// 10 is the fixed seed value
-            m_unidist = std::uniform_int_distribution<>(min,max);
-        }
-        else if (type == UNIFORMREAL) { //the case of UNIFORMREAL to generate real numbers
-            m_generator = std::mt19937(10);// 10 is the fixed seed value
-            m_uniReal = std::uniform_real_distribution<double>((double)min,(double)max);
-        }
-        else { //the case of SHUFFLE to generate every number only once
-            m_generator = std::mt19937(m_device());
-        }
-    }
-    void setSeed(int seedNum){
-        // we have set a default value for seed in constructor
-        // we can change the seed by calling this function after constructor call
-        // this gives us more randomness
-        m_generator = std::mt19937(seedNum);
-    }
-    void init(int min, int max){
-        m_min = min;
-        m_max = max;
-        m_type = UNIFORMINT;
-        m_generator = std::mt19937(10);// 10 is the fixed seed value
-        m_unidist = std::uniform_int_distribution<>(min,max);
-    }
-    void getShuffle(vector<int> & array){
-        // this function provides a list of all values between min and max
-        // in a random order, this function guarantees the uniqueness
-        // of every value in the list
-        // the user program creates the vector param and passes here
-        // here we populate the vector using m_min and m_max
-        for (int i = m_min; i<=m_max; i++){
-            array.push_back(i);
-        }
-        shuffle(array.begin(),array.end(),m_generator);
-    }
-
-    void getShuffle(int array[]){
-        // this function provides a list of all values between min and max
-        // in a random order, this function guarantees the uniqueness
-        // of every value in the list
-        // the param array must be of the size (m_max-m_min+1)
-        // the user program creates the array and pass it here
-        vector<int> temp;
-        for (int i = m_min; i<=m_max; i++){
-            temp.push_back(i);
-        }
-        std::shuffle(temp.begin(), temp.end(), m_generator);
-        vector<int>::iterator it;
-        int i = 0;
-        for (it=temp.begin(); it != temp.end(); it++){
-            array[i] = *it;
-            i++;
-        }
-    }
-
-    int getRandNum(){
-        // this function returns integer numbers
-        // the object must have been initialized to generate integers
-        int result = 0;
-        if(m_type == NORMAL){
-            //returns a random number in a set with normal distribution
-            //we limit random numbers by the min and max values
-            result = m_min - 1;
-            while(result < m_min || result > m_max)
-                result = m_normdist(m_generator);
-        }
-        else if (m_type == UNIFORMINT){
-            //this will generate a random number between min and max values
-            result = m_unidist(m_generator);
-        }
-        return result;
-    }
-
-    double getRealRandNum(){
-        // this function returns real numbers
-        // the object must have been initialized to generate real numbers
-        double result = m_uniReal(m_generator);
-        // a trick to return numbers only with two deciaml points
-        // for example if result is 15.0378, function returns 15.03
-        // to round up we can use ceil function instead of floor
-        result = std::floor(result*100.0)/100.0;
-        return result;
-    }
-
-    string getRandString(int size){
-        // the parameter size specifies the length of string we ask for
-        // to use ASCII char the number range in constructor must be set to 97 - 122
-        // and the Random type must be UNIFORMINT (it is default in constructor)
-        string output = "";
-        for (int i=0;i<size;i++){
-            output = output + (char)getRandNum();
-        }
-        return output;
-    }
-    
-    int getMin(){return m_min;}
-    int getMax(){return m_max;}
-    private:
-    int m_min;
-    int m_max;
-    RANDOM m_type;
-    std::random_device m_device;
-    std::mt19937 m_generator;
-    std::normal_distribution<> m_normdist;//normal distribution
-    std::uniform_int_distribution<> m_unidist;//integer uniform distribution
-    std::uniform_real_distribution<double> m_uniReal;//real uniform distribution
-
-};
-
 unsigned int hashCode(const string str) {
    unsigned int val = 0 ;
    const unsigned int thirtyThree = 33 ;  // magic number from textbook
@@ -145,6 +21,11 @@ string namesDB[6] = {"driver.cpp", "test.cpp", "test.h", "info.txt", "mydocument
 class Tester{
 };
 
+// Counts the files evicted in cache mode into the int at context (Test 8)
+void countEviction(const File&, void* context) {
+    (*static_cast<int*>(context))++;
+}
+
 // A helper function to generate colliding keys
 std::string generateCollidingKey(const std::string& base, int modifier, int tableSize, hash_fn hash) {
     std::string key = base + std::to_string(modifier);
@@ -467,6 +348,856 @@ if (result) {
         cout << "\nTEST 6 FAILED: Some operations did not work as expected.\n";
     }
 
+    // Test 7: Miss filter rejects absent keys and stays in sync with insert, remove and rehash
+    cout << "\nTest 7 Testing the negative-lookup filter:\n";
+    result = true;
+    {
+        FileSys filterSys(MINPRIME, hashCode, QUADRATIC);
+        filterSys.enableMissFilter(0.01, 4096);
+        vector<File> filterList;
+        // Insert enough files to trigger a few rehashes
+        for (int i = 0; i < 300; i++) {
+            File dataObj = File("file" + to_string(i) + ".txt", DISKMIN + i, true);
+            filterList.push_back(dataObj);
+            if (!filterSys.insert(dataObj)) {
+                result = false;
+            }
+        }
+        // Remove every third file
+        for (int i = 0; i < 300; i += 3) {
+            if (!filterSys.remove(filterList[i])) {
+                result = false;
+            }
+        }
+        // The filter must never reject a stored file
+        for (int i = 0; i < 300; i++) {
+            try {
+                filterSys.getFile(filterList[i].getName(), filterList[i].getDiskBlock());
+                if (i % 3 == 0) {
+                    result = false; // removed file was found
+                }
+            } catch (const std::runtime_error& e) {
+                if (i % 3 != 0) {
+                    result = false; // live file was rejected
+                }
+            }
+        }
+        // Absent keys should be mostly rejected by the filter alone
+        FilterStats before = filterSys.filterStats();
+        for (int i = 0; i < 1000; i++) {
+            try {
+                filterSys.getFile("absent" + to_string(i), DISKMIN + i);
+                result = false;
+            } catch (const std::runtime_error& e) {
+                // Expected behavior, file was never inserted
+            }
+        }
+        FilterStats after = filterSys.filterStats();
+        long rejected = after.rejected - before.rejected;
+        if (!after.enabled || after.bytes > 4096 || rejected < 900) {
+            result = false;
+        }
+        cout << "Filter bytes: " << after.bytes << ", hashes: " << after.numHashes
+             << ", rejected " << rejected << " of 1000 absent keys\n";
+    }
+
+    // Test 7 Result
+    if (result) {
+        cout << "\nTEST 7 PASSED: The miss filter kept every stored file and rejected absent ones!\n";
+    } else {
+        cout << "\nTEST 7 FAILED: The miss filter returned wrong results.\n";
+    }
+
+    // Test 8: Cache mode evicts with CLOCK instead of failing when full
+    cout << "\nTest 8 Testing bounded cache mode:\n";
+    result = true;
+    {
+        const int CACHESIZE = 50;
+        FileSys cacheSys(MINPRIME, hashCode, QUADRATIC);
+        int evictedCount = 0;
+        cacheSys.enableCacheMode(CACHESIZE, countEviction, &evictedCount);
+        File hotFile("hot.txt", DISKMIN, true);
+        if (!cacheSys.insert(hotFile)) {
+            result = false;
+        }
+        vector<File> cacheList;
+        for (int i = 1; i <= 200; i++) {
+            // Touch the hot file before every insert, CLOCK must keep it
+            try {
+                cacheSys.getFile(hotFile.getName(), hotFile.getDiskBlock());
+            } catch (const std::runtime_error& e) {
+                result = false;
+            }
+            File dataObj = File("cached" + to_string(i), DISKMIN + i, true);
+            cacheList.push_back(dataObj);
+            if (!cacheSys.insert(dataObj)) {
+                result = false; // a full cache must never reject an insert
+            }
+        }
+        int present = 0;
+        cacheList.push_back(hotFile);
+        for (const auto& file : cacheList) {
+            try {
+                cacheSys.getFile(file.getName(), file.getDiskBlock());
+                present++;
+            } catch (const std::runtime_error& e) {
+                // Evicted
+            }
+        }
+        try {
+            cacheSys.getFile(hotFile.getName(), hotFile.getDiskBlock());
+        } catch (const std::runtime_error& e) {
+            result = false;
+        }
+        if (present != CACHESIZE || evictedCount != 201 - CACHESIZE ||
+            cacheSys.numEvictions() != evictedCount) {
+            result = false;
+        }
+        cout << "Files cached: " << present << ", evicted: " << evictedCount << endl;
+    }
+    {
+        // a table full at MAXPRIME, the bound cache mode lifts, has no empty
+        // slot left and probing for an absent file must give up
+        FileSys fullSys(MINPRIME, hashCode, QUADRATIC);
+        for (int i = 0; i < 2000; i++) {
+            fullSys.insert(File("full" + to_string(i), DISKMIN + i, true));
+        }
+        int answered = 0;
+        for (int i = 0; i < 100; i++) {
+            File absent("absent" + to_string(i), DISKMIN, true);
+            answered += !fullSys.updateDiskBlock(absent, DISKMAX);
+            answered += !fullSys.remove(absent);
+            try {
+                fullSys.getFile(absent.getName(), absent.getDiskBlock());
+            } catch (const std::runtime_error& e) {
+                answered++;
+            }
+        }
+        if (answered != 300) {
+            result = false;
+        }
+    }
+    {
+        // every name collides, switching to cache mode must still place all the files it keeps
+        FileSys collideSys(MINPRIME, [](string) -> unsigned int { return 7; }, QUADRATIC);
+        int stored = 0;
+        for (int i = 0; i < 100; i++) {
+            stored += collideSys.insert(File("collide" + to_string(i), DISKMIN + i, true));
+        }
+        collideSys.enableCacheMode(20);
+        int kept = 0;
+        for (int i = 0; i < 100; i++) {
+            try {
+                collideSys.getFile("collide" + to_string(i), DISKMIN + i);
+                kept++;
+            } catch (const std::runtime_error& e) {
+            }
+        }
+        if (stored < 20 || kept != 20) {
+            result = false;
+        }
+    }
+    {
+        // every name collides, so b sits behind a's tombstone once a is removed
+        FileSys dupSys(MINPRIME, [](string) -> unsigned int { return 7; }, QUADRATIC);
+        dupSys.enableCacheMode(10);
+        dupSys.enableOrderedIndex();
+        File fileA("a.txt", DISKMIN, true);
+        File fileB("b.txt", DISKMIN, true);
+        dupSys.insert(fileA);
+        dupSys.insert(fileB);
+        dupSys.remove(fileA);
+        if (dupSys.insert(fileB) || !dupSys.remove(fileB) || dupSys.listPrefix("").valid()) {
+            result = false; // a duplicate behind a tombstone was inserted
+        }
+        try {
+            dupSys.getFile(fileB.getName(), fileB.getDiskBlock());
+            result = false;
+        } catch (const std::runtime_error& e) {
+        }
+    }
+
+    // Test 8 Result
+    if (result) {
+        cout << "\nTEST 8 PASSED: Cache mode stayed bounded and kept the hot file!\n";
+    } else {
+        cout << "\nTEST 8 FAILED: Cache mode did not evict as expected.\n";
+    }
+
+    // Test 9: A snapshot stays consistent while another thread keeps writing
+    cout << "\nTest 9 Testing snapshots with a concurrent writer:\n";
+    result = true;
+    {
+        const int FILES = 300;
+        FileSys liveSys(MINPRIME, hashCode, QUADRATIC);
+        vector<File> original;
+        for (int i = 0; i < FILES; i++) {
+            File dataObj = File("snap" + to_string(i) + ".txt", DISKMIN + i, true);
+            original.push_back(dataObj);
+            liveSys.insert(dataObj);
+        }
+        FileSysSnapshot* view = liveSys.snapshot();
+
+        // The writer replaces every file and moves blocks, round after round
+        std::atomic<bool> writing(true);
+        bool writerOk = true;
+        std::thread writer([&]() {
+            vector<File> current = original;
+            for (int round = 0; round < 20; round++) {
+                for (int i = 0; i < FILES; i++) {
+                    File next("snap" + to_string(i) + "_" + to_string(round) + ".txt", DISKMIN + i, true);
+                    if (!liveSys.remove(current[i]) || !liveSys.insert(next) ||
+                        !liveSys.updateDiskBlock(next, DISKMAX - i)) {
+                        writerOk = false;
+                    }
+                    next.setDiskBlock(DISKMAX - i);
+                    current[i] = next;
+                }
+            }
+            writing = false;
+        });
+
+        // The reader must see exactly the original files on every pass
+        int passes = 0;
+        while (writing || passes == 0) {
+            int seen = 0;
+            for (int i = 0; i < view->capacity(); i++) {
+                const File* file = view->fileAt(i);
+                if (file != nullptr) {
+                    seen++;
+                }
+            }
+            if (seen != FILES || view->size() != FILES) {
+                result = false;
+            }
+            for (const auto& file : original) {
+                try {
+                    if (!(view->getFile(file.getName(), file.getDiskBlock()) == file)) {
+                        result = false;
+                    }
+                } catch (const std::runtime_error& e) {
+                    result = false;
+                }
+            }
+            passes++;
+        }
+        writer.join();
+
+        // The live table moved on, the snapshot did not
+        try {
+            liveSys.getFile(original[0].getName(), original[0].getDiskBlock());
+            result = false;
+        } catch (const std::runtime_error& e) {
+            // Expected behavior, the writer replaced it
+        }
+        if (!writerOk) {
+            result = false;
+        }
+        cout << "Reader passes during writes: " << passes << endl;
+        delete view;
+    }
+    {
+        // at MAXPRIME tombstones make inserts rebuild the crowded table in place,
+        // a rebuild that cannot place every file must leave table and snapshot as they were
+        FileSys fullSys(MINPRIME, hashCode, QUADRATIC);
+        int stored = 0;
+        for (int i = 0; i < 2000; i++) {
+            stored += fullSys.insert(File("full" + to_string(i), DISKMIN + i, true));
+        }
+        FileSysSnapshot* view = fullSys.snapshot();
+        for (int i = 0; i < 2000; i += 7) {
+            if (fullSys.remove(File("full" + to_string(i), DISKMIN + i, true))) {
+                stored--;
+            }
+        }
+        for (int i = 0; i < 500; i++) {
+            stored += fullSys.insert(File("more" + to_string(i), DISKMIN + i, true));
+        }
+        int found = 0;
+        int kept = 0;
+        for (int i = 0; i < 2000; i++) {
+            for (const string& name : {"full" + to_string(i), "more" + to_string(i)}) {
+                try {
+                    fullSys.getFile(name, DISKMIN + i);
+                    found++;
+                } catch (const std::runtime_error& e) {
+                }
+            }
+            try {
+                view->getFile("full" + to_string(i), DISKMIN + i);
+                kept++;
+            } catch (const std::runtime_error& e) {
+            }
+        }
+        if (found != stored || kept != view->size()) {
+            result = false;
+        }
+        cout << "Found " << found << " of " << stored << " files after in-place rebuilds\n";
+        delete view;
+    }
+
+    // Test 9 Result
+    if (result) {
+        cout << "\nTEST 9 PASSED: The snapshot stayed consistent during concurrent writes!\n";
+    } else {
+        cout << "\nTEST 9 FAILED: The snapshot changed under concurrent writes.\n";
+    }
+
+    // Test 10: Compact storage mode behaves like FileSys
+    cout << "\nTest 10 Testing compact storage mode:\n";
+    result = true;
+    {
+        CompactFileSys compactSys(MINPRIME, hashCode, QUADRATIC);
+        vector<File> compactList;
+        // Enough files to rehash well past MAXPRIME
+        for (int i = 0; i < 5000; i++) {
+            File dataObj = File(namesDB[i % 6] + to_string(i), DISKMIN + RndID.getRandNum() % 1000, i % 2 == 0);
+            compactList.push_back(dataObj);
+            if (!compactSys.insert(dataObj)) {
+                result = false;
+            }
+        }
+        // Duplicates and blocks that do not fit 20 bits are rejected
+        if (compactSys.insert(compactList[0]) || compactSys.insert(File("big.txt", 1 << 20, true))) {
+            result = false;
+        }
+        // Remove every other file and move the rest to a new block
+        for (int i = 0; i < 5000; i += 2) {
+            if (!compactSys.remove(compactList[i])) {
+                result = false;
+            }
+        }
+        for (int i = 1; i < 5000; i += 2) {
+            if (!compactSys.updateDiskBlock(compactList[i], DISKMAX - i)) {
+                result = false;
+            }
+            compactList[i].setDiskBlock(DISKMAX - i);
+        }
+        for (int i = 0; i < 5000; i++) {
+            try {
+                const File file = compactSys.getFile(compactList[i].getName(), compactList[i].getDiskBlock());
+                if (i % 2 == 0 || !(file == compactList[i]) || file.getUsed() != compactList[i].getUsed()) {
+                    result = false;
+                }
+            } catch (const std::runtime_error& e) {
+                if (i % 2 != 0) {
+                    result = false;
+                }
+            }
+        }
+        if (compactSys.size() != 2500) {
+            result = false;
+        }
+        cout << "Compact capacity: " << compactSys.capacity() << ", bytes per entry: "
+             << static_cast<double>(compactSys.memoryBytes()) / compactSys.size() << endl;
+    }
+    {
+        // Moving a file onto a (name, block) already stored is refused
+        CompactFileSys compactSys(MINPRIME, hashCode, QUADRATIC);
+        compactSys.insert(File("dup.txt", DISKMIN, true));
+        compactSys.insert(File("dup.txt", DISKMIN + 1, true));
+        if (compactSys.updateDiskBlock(File("dup.txt", DISKMIN, true), DISKMIN + 1) ||
+            compactSys.getFile("dup.txt", DISKMIN).getDiskBlock() != DISKMIN ||
+            compactSys.size() != 2) {
+            result = false;
+        }
+    }
+
+    // Test 10 Result
+    if (result) {
+        cout << "\nTEST 10 PASSED: Compact storage mode stored, updated and removed files correctly!\n";
+    } else {
+        cout << "\nTEST 10 FAILED: Compact storage mode returned wrong results.\n";
+    }
+
+    // Test 11: The ordered index lists prefixes and ranges in order and follows every change
+    cout << "\nTest 11 Testing the ordered name index:\n";
+    result = true;
+    {
+        FileSys indexSys(MINPRIME, hashCode, QUADRATIC);
+        // Files inserted before the index is enabled must be listed too
+        indexSys.insert(File("src/main.cpp", DISKMIN, true));
+        indexSys.enableOrderedIndex();
+        string dirs[] = {"src/", "lib/", "doc/"};
+        for (int i = 0; i < 200; i++) {
+            indexSys.insert(File(dirs[i % 3] + "file" + to_string(i), DISKMIN + i, true));
+        }
+        indexSys.remove(File("src/file0", DISKMIN, true));
+        indexSys.updateDiskBlock(File("src/file3", DISKMIN + 3, true), DISKMAX);
+
+        // every listed name has the prefix, in increasing order, with current blocks
+        int listed = 0;
+        string last = "";
+        bool movedFound = false;
+        for (NameIndex::Iterator it = indexSys.listPrefix("src/"); it.valid(); it.next()) {
+            if (it.name().compare(0, 4, "src/") != 0 || it.name() < last || it.name() == "src/file0") {
+                result = false;
+            }
+            if (it.name() == "src/file3") {
+                movedFound = (it.block() == DISKMAX);
+            }
+            last = it.name();
+            listed++;
+        }
+        // 67 src files inserted, one removed, plus src/main.cpp
+        if (listed != 67 || !movedFound) {
+            result = false;
+        }
+        // [doc/, lib/) holds exactly the doc files
+        int ranged = 0;
+        for (NameIndex::Iterator it = indexSys.listRange("doc/", "lib/"); it.valid(); it.next()) {
+            if (it.name().compare(0, 4, "doc/") != 0) {
+                result = false;
+            }
+            ranged++;
+        }
+        if (ranged != 66) {
+            result = false;
+        }
+        cout << "Listed " << listed << " files under src/ and " << ranged << " under doc/\n";
+    }
+    {
+        // Moving a file onto a (name, block) already stored is refused and the
+        // index still lists both entries once
+        FileSys indexSys(MINPRIME, hashCode, QUADRATIC);
+        indexSys.enableOrderedIndex();
+        indexSys.insert(File("src/dup", DISKMIN, true));
+        indexSys.insert(File("src/dup", DISKMIN + 1, true));
+        if (indexSys.updateDiskBlock(File("src/dup", DISKMIN, true), DISKMIN + 1)) {
+            result = false;
+        }
+        int listed = 0;
+        for (NameIndex::Iterator it = indexSys.listPrefix("src/dup"); it.valid(); it.next()) {
+            if (it.block() != DISKMIN + listed) {
+                result = false;
+            }
+            listed++;
+        }
+        if (listed != 2 ||
+            indexSys.getFile("src/dup", DISKMIN).getDiskBlock() != DISKMIN ||
+            indexSys.getFile("src/dup", DISKMIN + 1).getDiskBlock() != DISKMIN + 1) {
+            result = false;
+        }
+        cout << "Listed " << listed << " entries under src/dup after a duplicate update\n";
+    }
+
+    // Test 11 Result
+    if (result) {
+        cout << "\nTEST 11 PASSED: The ordered index listed prefixes and ranges correctly!\n";
+    } else {
+        cout << "\nTEST 11 FAILED: The ordered index returned wrong listings.\n";
+    }
+
+    // Test 12: A recorded trace reads back in order and replays to the same table
+    cout << "\nTest 12 Testing trace record and replay:\n";
+    result = true;
+    {
+        FileSys recorded(MINPRIME, hashCode, QUADRATIC);
+        if (!recorded.startTrace("test_trace.bin")) {
+            result = false;
+        }
+        for (int i = 0; i < 100; i++) {
+            recorded.insert(File("trace" + to_string(i), DISKMIN + i, true));
+        }
+        for (int i = 0; i < 100; i += 3) {
+            recorded.updateDiskBlock(File("trace" + to_string(i), DISKMIN + i, true), DISKMAX - i);
+        }
+        for (int i = 1; i < 100; i += 3) {
+            recorded.remove(File("trace" + to_string(i), DISKMIN + i, true));
+        }
+        try {
+            recorded.getFile("missing", DISKMIN);
+        } catch (const runtime_error& e) {
+        }
+        recorded.stopTrace();
+        // operations after stopTrace are not recorded
+        recorded.insert(File("untraced", DISKMIN, true));
+
+        TraceReader reader("test_trace.bin");
+        FileSys replayed(MINPRIME, hashCode, QUADRATIC);
+        TraceRecord record;
+        int records = 0;
+        int gets = 0;
+        while (reader.good() && reader.next(record)) {
+            records++;
+            if (record.m_op == TRACEINSERT) {
+                replayed.insert(File(record.m_name, record.m_block, true));
+            } else if (record.m_op == TRACEUPDATE) {
+                replayed.updateDiskBlock(File(record.m_name, record.m_block, true), record.m_newBlock);
+            } else if (record.m_op == TRACEREMOVE) {
+                replayed.remove(File(record.m_name, record.m_block, true));
+            } else {
+                gets += (record.m_name == "missing");
+            }
+        }
+        // 100 inserts, 34 updates, 33 removes and one lookup
+        if (records != 168 || gets != 1) {
+            result = false;
+        }
+        // the replayed table holds the recorded files, less the untraced one
+        try {
+            replayed.getFile("untraced", DISKMIN);
+            result = false;
+        } catch (const runtime_error& e) {
+        }
+        for (int i = 0; i < 100; i++) {
+            int block = (i % 3 == 0) ? DISKMAX - i : DISKMIN + i;
+            try {
+                replayed.getFile("trace" + to_string(i), block);
+                if (i % 3 == 1) {
+                    result = false; // removed files must not be found
+                }
+            } catch (const runtime_error& e) {
+                if (i % 3 != 1) {
+                    result = false;
+                }
+            }
+        }
+        cout << "Read back " << records << " records\n";
+        remove("test_trace.bin");
+    }
+
+    // Test 12 Result
+    if (result) {
+        cout << "\nTEST 12 PASSED: The trace replayed to the recorded table!\n";
+    } else {
+        cout << "\nTEST 12 FAILED: The trace did not replay correctly.\n";
+    }
+
+    // Test 13: Slot arrays mapped with each allocation policy keep files across rehashes and snapshots
+    cout << "\nTest 13 Testing slot array allocation policies:\n";
+    result = true;
+    {
+        FileSys mapped(MINPRIME, hashCode, QUADRATIC);
+        for (int i = 0; i < 700; i++) {
+            mapped.insert(File("page" + to_string(i), DISKMIN + i, true));
+        }
+        // a small table stays on the heap whatever the policy
+        mapped.setAllocPolicy(PAGETHP);
+        if (mapped.tablePages() != PAGEDEFAULT) {
+            result = false;
+        }
+        // cache mode sizes the table for 150000 files, a slot array of several MB,
+        // on base pages if the kernel has THP set to never
+        ifstream thpSetting("/sys/kernel/mm/transparent_hugepage/enabled");
+        string thp;
+        page_t expected = (getline(thpSetting, thp) && thp.find("[never]") == string::npos) ? PAGETHP : PAGEDEFAULT;
+        mapped.enableCacheMode(150000);
+        if (mapped.tablePages() != expected) {
+            result = false;
+        }
+        // the snapshot keeps the mapping alive after the table moves to another one
+        FileSysSnapshot* view = mapped.snapshot();
+        mapped.setAllocPolicy(PAGEHUGETLB, NUMAINTERLEAVE);
+        mapped.remove(File("page0", DISKMIN, true));
+        mapped.setAllocPolicy(PAGETHP, NUMAFIRSTTOUCH);
+        mapped.updateDiskBlock(File("page1", DISKMIN + 1, true), DISKMAX);
+        // hugetlb falls back to THP when no huge pages are reserved
+        if ((mapped.tablePages() != PAGEHUGETLB && mapped.tablePages() != expected) || view->size() != 700) {
+            result = false;
+        }
+        for (int i = 0; i < 700; i++) {
+            string name = "page" + to_string(i);
+            try {
+                view->getFile(name, DISKMIN + i);
+                mapped.getFile(name, (i == 1) ? DISKMAX : DISKMIN + i);
+                if (i == 0) {
+                    result = false; // removed from the table
+                }
+            } catch (const runtime_error& e) {
+                if (i != 0) {
+                    result = false;
+                }
+            }
+        }
+        delete view;
+        // back to the heap
+        mapped.setAllocPolicy(PAGEDEFAULT);
+        if (mapped.tablePages() != PAGEDEFAULT) {
+            result = false;
+        }
+        cout << "Moved 699 files through heap, THP, hugetlb and first-touch slot arrays\n";
+    }
+
+    // Test 13 Result
+    if (result) {
+        cout << "\nTEST 13 PASSED: Every allocation policy kept the files!\n";
+    } else {
+        cout << "\nTEST 13 FAILED: An allocation policy lost or misplaced files.\n";
+    }
+
+    // Test 14: A frozen table finds every file through the perfect hash, refuses changes and thaws back
+    cout << "\nTest 14 Testing freeze and thaw:\n";
+    result = true;
+    {
+        FileSys frozenSys(MINPRIME, hashCode, QUADRATIC);
+        frozenSys.enableMissFilter();
+        for (int i = 0; i < 600; i++) {
+            frozenSys.insert(File("frozen" + to_string(i), DISKMIN + i, true));
+        }
+        // tombstones are not carried into the perfect hash
+        for (int i = 0; i < 600; i += 5) {
+            frozenSys.remove(File("frozen" + to_string(i), DISKMIN + i, true));
+        }
+        if (!frozenSys.freeze() || !frozenSys.isFrozen() || frozenSys.lambda() != 1) {
+            result = false;
+        }
+        int found = 0;
+        for (int i = 0; i < 600; i++) {
+            try {
+                frozenSys.getFile("frozen" + to_string(i), DISKMIN + i);
+                found++;
+            } catch (const runtime_error& e) {
+            }
+            // same name with another block must miss
+            try {
+                frozenSys.getFile("frozen" + to_string(i), DISKMAX);
+                result = false;
+            } catch (const runtime_error& e) {
+            }
+        }
+        if (found != 480) {
+            result = false;
+        }
+        // every change is refused while frozen
+        int refused = 0;
+        try {
+            frozenSys.insert(File("late", DISKMIN, true));
+        } catch (const logic_error& e) {
+            refused++;
+        }
+        try {
+            frozenSys.remove(File("frozen1", DISKMIN + 1, true));
+        } catch (const logic_error& e) {
+            refused++;
+        }
+        try {
+            frozenSys.updateDiskBlock(File("frozen1", DISKMIN + 1, true), DISKMAX);
+        } catch (const logic_error& e) {
+            refused++;
+        }
+        if (refused != 3) {
+            result = false;
+        }
+        // the ordered index can still be built from the frozen files
+        frozenSys.enableOrderedIndex();
+        int listed = 0;
+        for (NameIndex::Iterator it = frozenSys.listPrefix("frozen"); it.valid(); it.next()) {
+            listed++;
+        }
+        frozenSys.thaw();
+        if (frozenSys.isFrozen() || listed != 480 ||
+            !frozenSys.insert(File("late", DISKMIN, true)) ||
+            !frozenSys.remove(File("frozen1", DISKMIN + 1, true))) {
+            result = false;
+        }
+        try {
+            frozenSys.getFile("late", DISKMIN);
+            frozenSys.getFile("frozen2", DISKMIN + 2);
+        } catch (const runtime_error& e) {
+            result = false;
+        }
+        // an empty table freezes too
+        FileSys emptySys(MINPRIME, hashCode, QUADRATIC);
+        if (!emptySys.freeze()) {
+            result = false;
+        }
+        try {
+            emptySys.getFile("none", DISKMIN);
+            result = false;
+        } catch (const runtime_error& e) {
+        }
+        cout << "Found " << found << " of 480 files in the frozen table, " << refused << " changes refused\n";
+    }
+
+    // Test 14 Result
+    if (result) {
+        cout << "\nTEST 14 PASSED: The frozen table answered lookups and thawed correctly!\n";
+    } else {
+        cout << "\nTEST 14 FAILED: The frozen table lost files or accepted changes.\n";
+    }
+
+    // Test 15: The SIMD batch hashes equal hashCode, and batch inserts and lookups agree with single ones
+    cout << "\nTest 15 Testing batch hashing:\n";
+    result = true;
+    {
+        // names of every length up to 40, with chars above 127 that sign-extend
+        vector<string> names;
+        Random rndChar(1, 255);
+        for (int i = 0; i < 200; i++) {
+            string name;
+            for (int j = 0; j < i % 41; j++) {
+                name += static_cast<char>(rndChar.getRandNum());
+            }
+            names.push_back(name);
+        }
+        vector<const string*> pointers;
+        for (const string& name : names) {
+            pointers.push_back(&name);
+        }
+        simd_t kernels[] = {SIMDSCALAR, SIMDSSE2, SIMDAVX2, SIMDAVX512};
+        for (simd_t kernel : kernels) {
+            vector<unsigned int> hashes(names.size());
+            hashCode33BatchWith(kernel, pointers.data(), static_cast<int>(names.size()), hashes.data());
+            for (size_t i = 0; i < names.size(); i++) {
+                if (hashes[i] != hashCode(names[i]) || hashCode33(names[i]) != hashCode(names[i])) {
+                    result = false;
+                }
+            }
+        }
+        // batches of 8 average from 3.5 to 35.5 bytes, on both sides of SIMDMINLENGTH
+        for (size_t first = 0; first < names.size(); first += 8) {
+            unsigned int hashes[8];
+            hashCode33Batch(pointers.data() + first, 8, hashes);
+            for (size_t i = 0; i < 8; i++) {
+                if (hashes[i] != hashCode(names[first + i])) {
+                    result = false;
+                }
+            }
+        }
+
+        // a batch-hashed table holds and finds the same files as one inserted file by file
+        FileSys batchSys(MINPRIME, hashCode, QUADRATIC);
+        batchSys.setBatchHash(hashCode33Batch);
+        FileSys singleSys(MINPRIME, hashCode, QUADRATIC);
+        vector<File> files;
+        for (int i = 0; i < 600; i++) {
+            files.push_back(File("batch" + to_string(i), DISKMIN + i, true));
+        }
+        int inserted = batchSys.insertBatch(files.data(), 600);
+        for (const File& file : files) {
+            singleSys.insert(file);
+        }
+        if (inserted != 600 || batchSys.insertBatch(files.data(), 10) != 0) {
+            result = false; // duplicates are rejected as by insert
+        }
+        vector<string> lookupNames;
+        vector<int> lookupBlocks;
+        for (int i = 0; i < 700; i += 2) {
+            lookupNames.push_back("batch" + to_string(i));
+            lookupBlocks.push_back(DISKMIN + i);
+        }
+        int lookups = static_cast<int>(lookupNames.size());
+        vector<File> found(lookups);
+        bool* foundFlags = new bool[lookups];
+        int numFound = batchSys.getFiles(lookupNames.data(), lookupBlocks.data(), lookups, found.data(), foundFlags);
+        for (int i = 0; i < lookups; i++) {
+            bool stored = true;
+            try {
+                singleSys.getFile(lookupNames[i], lookupBlocks[i]);
+            } catch (const runtime_error& e) {
+                stored = false;
+            }
+            if (foundFlags[i] != stored || (stored && found[i].getName() != lookupNames[i])) {
+                result = false;
+            }
+        }
+        delete[] foundFlags;
+        if (numFound != 300) {
+            result = false;
+        }
+        cout << "Kernels up to " << simdSupport() << " agree with hashCode, batch lookups found "
+             << numFound << " of " << lookups << " keys\n";
+    }
+
+    // Test 15 Result
+    if (result) {
+        cout << "\nTEST 15 PASSED: Batch hashing matched hashCode and the batch operations!\n";
+    } else {
+        cout << "\nTEST 15 FAILED: Batch hashing disagreed with hashCode.\n";
+    }
+
+    // Test 16: Two diverged replicas find exactly their differing files through digests
+    cout << "\nTest 16 Testing replica digests:\n";
+    result = true;
+    {
+        FileSys replicaA(MINPRIME, hashCode, QUADRATIC);
+        FileSys replicaB(MINPRIME, hashCode, QUADRATIC);
+        replicaA.enableDigests(); // A tracks every change, B builds its digests afterwards
+        for (int i = 0; i < 500; i++) {
+            replicaA.insert(File("replica" + to_string(i), DISKMIN + i, true));
+            replicaB.insert(File("replica" + to_string(i), DISKMIN + i, true));
+        }
+        for (int i = 0; i < 3; i++) {
+            replicaA.insert(File("onlyA" + to_string(i), DISKMIN + i, true));
+        }
+        replicaB.remove(File("replica10", DISKMIN + 10, true));
+        replicaB.remove(File("replica20", DISKMIN + 20, true));
+        replicaA.updateDiskBlock(File("replica30", DISKMIN + 30, true), DISKMAX);
+        // a file added and removed again leaves no trace in the digests
+        replicaA.insert(File("transient", DISKMIN, true));
+        replicaA.remove(File("transient", DISKMIN, true));
+        try {
+            replicaB.digests();
+            result = false;
+        } catch (const logic_error& e) {
+        }
+        replicaB.enableDigests();
+
+        auto key = [](const File& file) { return file.getName() + "@" + to_string(file.getDiskBlock()); };
+        auto keys = [&](const vector<File>& files) {
+            vector<string> out;
+            for (const File& file : files) {
+                out.push_back(key(file));
+            }
+            sort(out.begin(), out.end());
+            return out;
+        };
+        vector<string> expectA = {"onlyA0@" + to_string(DISKMIN), "onlyA1@" + to_string(DISKMIN + 1),
+                                  "onlyA2@" + to_string(DISKMIN + 2), "replica10@" + to_string(DISKMIN + 10),
+                                  "replica20@" + to_string(DISKMIN + 20), "replica30@" + to_string(DISKMAX)};
+        vector<string> expectB = {"replica30@" + to_string(DISKMIN + 30)};
+        sort(expectA.begin(), expectA.end());
+
+        // in process
+        vector<File> onlyA, onlyB;
+        replicaA.diff(replicaB, onlyA, onlyB);
+        if (keys(onlyA) != expectA || keys(onlyB) != expectB) {
+            result = false;
+        }
+
+        // between processes: B sends its digests, A answers with its files in the differing ranges
+        DigestTree remote;
+        vector<File> sent, received;
+        if (!replicaB.digests().save("replicaB.digest") || !remote.load("replicaB.digest")) {
+            result = false;
+        }
+        vector<int> ranges = replicaA.digests().diffRanges(remote);
+        if (ranges.empty() || ranges.size() > 7 || ranges != replicaB.digests().diffRanges(replicaA.digests())) {
+            result = false;
+        }
+        if (!DigestTree::saveEntries("replicaA.entries", replicaA.digests().entries(ranges)) ||
+            !DigestTree::loadEntries("replicaA.entries", received)) {
+            result = false;
+        }
+        DigestTree::diffEntries(replicaB.digests().entries(ranges), received, onlyB, onlyA);
+        if (keys(onlyA) != expectA || keys(onlyB) != expectB) {
+            result = false;
+        }
+        // B repairs itself, after which the replicas agree
+        for (const File& file : onlyB) {
+            replicaB.remove(file);
+        }
+        for (const File& file : onlyA) {
+            replicaB.insert(file);
+        }
+        replicaA.diff(replicaB, onlyA, onlyB);
+        if (!onlyA.empty() || !onlyB.empty() || !replicaA.digests().diffRanges(replicaB.digests()).empty()) {
+            result = false;
+        }
+        cout << "Replicas differed in " << ranges.size() << " of " << DIGESTRANGES << " ranges, "
+             << received.size() << " files exchanged\n";
+        remove("replicaB.digest");
+        remove("replicaA.entries");
+    }
+
+    // Test 16 Result
+    if (result) {
+        cout << "\nTEST 16 PASSED: The digests found exactly the files that differ between replicas!\n";
+    } else {
+        cout << "\nTEST 16 FAILED: The digests missed or invented a difference between replicas.\n";
+    }
+
 return 0;
 
 }